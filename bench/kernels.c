@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "../cat_png_functions/crc.h"
+#include "../cat_png_functions/zutil.h"
+#include "../cat_png_functions/shmseg.h"
+#include "../cat_png_functions/pyramid.h"
+
+#define REPS 5         // timed runs per case, the best one counts
+#define ROW 1600       // bytes of a 400 pixel RGBA row, what downscale takes in pairs
+#define MAX_SIZE (16 << 20)
+
+// one kernel at one input size (and compression level)
+typedef struct bench_case
+{
+    const char *kernel;
+    unsigned long size;
+    int level; // -1 where it doesn't apply
+} bench_case;
+
+typedef struct result
+{
+    double gbps;           // input bytes per ns
+    double cycles_per_byte; // TSC cycles, 0 where there's no TSC
+} result;
+
+static const bench_case cases[] = {
+    {"crc", 64, -1}, {"crc", 4096, -1}, {"crc", 65536, -1}, {"crc", 1 << 20, -1}, {"crc", 16 << 20, -1},
+    {"update_crc", 64, -1}, {"update_crc", 4096, -1}, {"update_crc", 65536, -1}, {"update_crc", 1 << 20, -1},
+    {"mem_def", 4096, 1}, {"mem_def", 4096, 6}, {"mem_def", 4096, 9},
+    {"mem_def", 65536, 1}, {"mem_def", 65536, 6}, {"mem_def", 65536, 9},
+    {"mem_def", 1 << 20, 1}, {"mem_def", 1 << 20, 6}, {"mem_def", 1 << 20, 9},
+    {"mem_inf", 4096, 6}, {"mem_inf", 65536, 6}, {"mem_inf", 1 << 20, 6}, {"mem_inf", 16 << 20, 6},
+    {"downscale", 2 * ROW, -1}, {"downscale", 40 * ROW, -1}, {"downscale", 640 * ROW, -1},
+};
+#define NUM_CASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+static U8 *input;      // image-like bytes, MAX_SIZE of them
+static U8 *packed;     // input deflated, for mem_inf
+static U8 *out;        // where kernels write
+static U64 packed_len;
+static volatile unsigned long sink; // keeps results alive
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief  RGBA rows that compress about like the fragments do: smooth
+ *         gradients with a little noise in the low bits
+ */
+static void make_input(U8 *buf, unsigned long len)
+{
+    uint32_t x = 2463534242u;
+    for (unsigned long i = 0; i < len; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        unsigned long px = i / 4, row = px / 400;
+        buf[i] = (U8)((i % 4 == 3) ? 255 : (px % 400) / 2 + row * (i % 4 + 1) + (x & 7));
+    }
+}
+
+static void run_once(const bench_case *c)
+{
+    U64 len = 0;
+    if (strcmp(c->kernel, "crc") == 0)
+    {
+        sink += crc(input, (int)c->size);
+    }
+    else if (strcmp(c->kernel, "update_crc") == 0)
+    {
+        sink += update_crc(0xffffffffL, input, (int)c->size);
+    }
+    else if (strcmp(c->kernel, "mem_def") == 0)
+    {
+        mem_def(out, &len, input, c->size, c->level);
+        sink += len;
+    }
+    else if (strcmp(c->kernel, "downscale") == 0)
+    {
+        for (unsigned long off = 0; off + 2 * ROW <= c->size; off += 2 * ROW)
+        {
+            pyramid_downscale_row(out + off / 4, input + off, input + off + ROW, ROW / 4);
+        }
+        sink += out[0];
+    }
+    else
+    {
+        mem_inf(out, &len, packed, packed_len);
+        sink += len;
+    }
+}
+
+/**
+ * @brief  time a case: find how many calls take min_s, then keep the best of REPS such runs
+ */
+static result run_case(const bench_case *c, double min_s)
+{
+    result r = {0, 0};
+    long iters = 1;
+
+    if (strcmp(c->kernel, "mem_inf") == 0)
+    {
+        // what the kernel undoes is level 6 output of the same input
+        packed_len = 0;
+        mem_def(packed, &packed_len, input, c->size, c->level);
+    }
+    run_once(c); // warm caches and tables
+    for (;;)
+    {
+        double t = now_ns();
+        for (long i = 0; i < iters; i++)
+        {
+            run_once(c);
+        }
+        if (now_ns() - t >= min_s * 1e9)
+        {
+            break;
+        }
+        iters *= 2;
+    }
+    double best = 0;
+    uint64_t best_cycles = 0;
+    for (int rep = 0; rep < REPS; rep++)
+    {
+        uint64_t c0 = cycles();
+        double t = now_ns();
+        for (long i = 0; i < iters; i++)
+        {
+            run_once(c);
+        }
+        t = now_ns() - t;
+        uint64_t c1 = cycles();
+        if (best == 0 || t < best)
+        {
+            best = t;
+            best_cycles = c1 - c0;
+        }
+    }
+    double bytes = (double)c->size * iters;
+    r.gbps = bytes / best;
+    r.cycles_per_byte = best_cycles / bytes;
+    return r;
+}
+
+/**
+ * @brief  a saved baseline's GB/s for each case, 0 where it has none
+ * @return 0 on success, -1 if there is no such file
+ */
+static int load_baseline(const char *path, double *base)
+{
+    FILE *f = fopen(path, "r");
+    char line[128], kernel[32];
+    unsigned long size;
+    int level;
+    double gbps;
+    if (f == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "%31s %lu %d %lf", kernel, &size, &level, &gbps) != 4) // comments
+        {
+            continue;
+        }
+        for (int i = 0; i < NUM_CASES; i++)
+        {
+            if (strcmp(cases[i].kernel, kernel) == 0 && cases[i].size == size && cases[i].level == level)
+            {
+                base[i] = gbps;
+            }
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int save_baseline(const char *path, const result *res)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "# kernel size level GB/s\n");
+    for (int i = 0; i < NUM_CASES; i++)
+    {
+        fprintf(f, "%s %lu %d %.4f\n", cases[i].kernel, cases[i].size, cases[i].level, res[i].gbps);
+    }
+    fclose(f);
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c cpu] [-t seconds] [-b baseline [-p percent]] [-s baseline]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int cpu = -1;              // pin to this CPU, -1 = the first one we may use
+    double min_s = 0.05;       // length of a timed run
+    const char *compare = NULL; // baseline to check against, saved if missing
+    const char *save = NULL;    // baseline to write
+    double tolerance = 10;     // % slower than the baseline that counts as a regression
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:b:p:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 't':
+            min_s = atof(optarg);
+            break;
+        case 'b':
+            compare = optarg;
+            break;
+        case 'p':
+            tolerance = atof(optarg);
+            break;
+        case 's':
+            save = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // one CPU for the whole run, so the cycle counts and caches are that CPU's
+    if (cpu < 0 && cpu_list(&cpu, 1) < 1)
+    {
+        cpu = 0;
+    }
+    if (pin_cpu(cpu) != 0)
+    {
+        perror("sched_setaffinity");
+    }
+
+    input = malloc(MAX_SIZE);
+    packed = malloc(MAX_SIZE + MAX_SIZE / 100 + 1024); // deflate may grow it a little
+    out = malloc(MAX_SIZE + MAX_SIZE / 100 + 1024);
+    make_input(input, MAX_SIZE);
+    make_crc_table();
+
+    double base[NUM_CASES] = {0};
+    int have_base = compare != NULL && load_baseline(compare, base) == 0;
+    result res[NUM_CASES];
+    int regressions = 0;
+
+    printf("pinned to CPU %d, cycles are %s\n", cpu,
+#if defined(__x86_64__) || defined(__i386__)
+           "TSC reference cycles"
+#else
+           "not available"
+#endif
+    );
+    printf("%-10s %9s %5s %9s %9s %9s %8s\n", "kernel", "bytes", "level", "GB/s", "cycles/B", "baseline", "change");
+    for (int i = 0; i < NUM_CASES; i++)
+    {
+        res[i] = run_case(cases + i, min_s);
+        printf("%-10s %9lu %5d %9.3f %9.3f", cases[i].kernel, cases[i].size, cases[i].level, res[i].gbps,
+               res[i].cycles_per_byte);
+        if (base[i] > 0)
+        {
+            double change = (res[i].gbps / base[i] - 1) * 100;
+            int slower = change < -tolerance;
+            printf(" %9.3f %+7.1f%%%s", base[i], change, slower ? "  REGRESSION" : "");
+            regressions += slower;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (save != NULL || (compare != NULL && !have_base))
+    {
+        const char *path = save != NULL ? save : compare;
+        if (save_baseline(path, res) == 0)
+        {
+            printf("baseline saved to %s\n", path);
+        }
+    }
+    if (regressions > 0)
+    {
+        printf("%d cases more than %.0f%% slower than the baseline\n", regressions, tolerance);
+    }
+    free(input);
+    free(packed);
+    free(out);
+    return regressions > 0;
+}
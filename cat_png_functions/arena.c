@@ -0,0 +1,198 @@
+/**
+ * @file: arena.c
+ * @brief: per process allocator for buffers that come and go at a steady
+ *         rate: power of two size classes carved from large mappings and
+ *         recycled through free lists, never given back until the end
+ *
+ * A worker that allocates and frees the same few buffer sizes for every
+ * fragment gets the same memory back each time from the class free list,
+ * with its pages already faulted in, instead of malloc mapping and
+ * unmapping a fresh region for each large buffer. Small classes are bumped
+ * out of ARENA_BLOCK sized mappings; a class over half a block gets a
+ * mapping of its own, which is recycled the same way. Nothing is locked:
+ * an arena belongs to one process (or thread).
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/* in front of every buffer, keeps buffers 16 byte aligned */
+typedef struct arena_hdr {
+    unsigned int cls;
+    unsigned int pad[3];
+} arena_hdr;
+
+/* at the start of every mapping */
+typedef struct arena_map {
+    struct arena_map *next;
+    size_t len;
+} arena_map;
+
+#define HDR sizeof(arena_hdr)
+#define MAP_HDR ((sizeof(arena_map) + 15) & ~15UL)
+
+void arena_init(arena *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+/**
+ * @brief: unmap everything, every buffer from the arena goes with it
+ */
+void arena_destroy(arena *a)
+{
+    arena_map *m = a->maps;
+
+    while (m != NULL) {
+        arena_map *next = m->next;
+
+        munmap(m, m->len);
+        m = next;
+    }
+    arena_init(a);
+}
+
+static void *map(arena *a, size_t len)
+{
+    arena_map *m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (m == MAP_FAILED)
+        return NULL;
+    m->next = a->maps;
+    m->len = len;
+    a->maps = m;
+    a->stats.maps++;
+    a->stats.mapped += len;
+    return (char *) m + MAP_HDR;
+}
+
+static int size_class(size_t size)
+{
+    int cls = 0;
+
+    while (((size_t) 1 << (cls + ARENA_MIN_SHIFT)) < size)
+        cls++;
+    return cls;
+}
+
+/**
+ * @brief: a buffer of at least size bytes, 16 byte aligned
+ * @return NULL if size is over the largest class or memory ran out
+ */
+void *arena_alloc(arena *a, size_t size)
+{
+    int cls = size_class(size);
+    size_t chunk;
+    char *p;
+
+    if (cls >= ARENA_CLASSES)
+        return NULL;
+    chunk = HDR + ((size_t) 1 << (cls + ARENA_MIN_SHIFT));
+    if (a->free[cls] != NULL) {
+        p = a->free[cls];
+        memcpy(&a->free[cls], p, sizeof(void *)); /* link kept in the buffer */
+        a->stats.reused++;
+        p -= HDR;
+    } else if (chunk > ARENA_BLOCK / 2) {
+        p = map(a, MAP_HDR + chunk);
+    } else {
+        if (a->bump == NULL || (size_t) (a->end - a->bump) < chunk) {
+            /* the rest of the old block is left over */
+            a->bump = map(a, ARENA_BLOCK);
+            if (a->bump == NULL)
+                return NULL;
+            a->end = a->bump + ARENA_BLOCK - MAP_HDR;
+        }
+        p = a->bump;
+        a->bump += chunk;
+    }
+    if (p == NULL)
+        return NULL;
+    ((arena_hdr *) p)->cls = cls;
+    a->stats.allocs++;
+    a->stats.in_use += chunk - HDR;
+    if (a->stats.in_use > a->stats.peak)
+        a->stats.peak = a->stats.in_use;
+    return p + HDR;
+}
+
+/**
+ * @brief: give a buffer back to its class, NULL does nothing
+ */
+void arena_free(arena *a, void *p)
+{
+    if (p == NULL)
+        return;
+
+    int cls = ((arena_hdr *) ((char *) p - HDR))->cls;
+
+    memcpy(p, &a->free[cls], sizeof(void *));
+    a->free[cls] = p;
+    a->stats.frees++;
+    a->stats.in_use -= (size_t) 1 << (cls + ARENA_MIN_SHIFT);
+}
+
+/**
+ * @brief: grow or shrink a buffer like realloc(); it stays put while size
+ *         still fits its class
+ */
+void *arena_realloc(arena *a, void *p, size_t size)
+{
+    if (p == NULL)
+        return arena_alloc(a, size);
+
+    int cls = ((arena_hdr *) ((char *) p - HDR))->cls;
+    size_t have = (size_t) 1 << (cls + ARENA_MIN_SHIFT);
+
+    if (size <= have)
+        return p;
+
+    void *q = arena_alloc(a, size);
+
+    if (q == NULL)
+        return NULL;
+    memcpy(q, p, have);
+    arena_free(a, p);
+    return q;
+}
+
+/**
+ * @brief: zlib allocation hooks, opaque is the arena (z_stream zalloc,
+ *         zfree and opaque)
+ */
+void *arena_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+    return arena_alloc(opaque, (size_t) items * size);
+}
+
+void arena_zfree(void *opaque, void *p)
+{
+    arena_free(opaque, p);
+}
+
+static void atomic_max(unsigned long *dst, unsigned long v)
+{
+    unsigned long cur = __atomic_load_n(dst, __ATOMIC_RELAXED);
+
+    while (cur < v && !__atomic_compare_exchange_n(dst, &cur, v, 1,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief: add an arena's counts to a total other processes add to too;
+ *         peak becomes the largest peak of any of them
+ */
+void arena_stats_add(arena_stats *sum, const arena_stats *s)
+{
+    __atomic_add_fetch(&sum->allocs, s->allocs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sum->reused, s->reused, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sum->frees, s->frees, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sum->maps, s->maps, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sum->mapped, s->mapped, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sum->in_use, s->in_use, __ATOMIC_RELAXED);
+    atomic_max(&sum->peak, s->peak);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file: arena.h
+ * @brief: per process allocator for buffers that come and go at a steady
+ *         rate: power of two size classes carved from large mappings and
+ *         recycled through free lists, never given back until the end
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* DEFINES */
+#define ARENA_BLOCK     (4UL << 20) /* bytes mapped at a time for small classes */
+#define ARENA_MIN_SHIFT 6           /* smallest class, 64 bytes */
+#define ARENA_CLASSES   26          /* up to 2^31 bytes */
+
+/* TYPEDEFS */
+typedef struct arena_stats {
+    unsigned long allocs; /* buffers handed out */
+    unsigned long reused; /* of them from a free list, no new memory */
+    unsigned long frees;
+    unsigned long maps;   /* mappings made */
+    unsigned long mapped; /* bytes mapped */
+    unsigned long in_use; /* bytes handed out and not freed */
+    unsigned long peak;   /* most bytes in use at once */
+} arena_stats;
+
+typedef struct arena {
+    char *bump;                  /* next free byte of the current block */
+    char *end;                   /* end of the current block */
+    void *free[ARENA_CLASSES];   /* freed buffers of each class */
+    void *maps;                  /* every mapping, to unmap them at the end */
+    arena_stats stats;
+} arena;
+
+/* FUNCTION PROTOTYPES */
+void arena_init(arena *a);
+void arena_destroy(arena *a);
+void *arena_alloc(arena *a, size_t size);
+void *arena_realloc(arena *a, void *p, size_t size);
+void arena_free(arena *a, void *p);
+void *arena_zalloc(void *opaque, unsigned int items, unsigned int size);
+void arena_zfree(void *opaque, void *p);
+void arena_stats_add(arena_stats *sum, const arena_stats *s);
@@ -4,9 +4,16 @@
  * Reference: https://www.w3.org/TR/PNG-CRCAppendix.html
  */
 
+#include <stdint.h>
+#include <string.h>
+
 /* Table of CRCs of all 8-bit messages. */
 unsigned long crc_table[256];
 
+/* Slicing by 8: crc_slice[k][n] is the CRC of byte n followed by k zero
+   bytes, so eight bytes are folded in with eight independent lookups. */
+static uint32_t crc_slice[8][256];
+
 /* Flag: has the table been computed? Initially false. */
 int crc_table_computed = 0;
 
@@ -25,8 +32,14 @@ void make_crc_table(void)
                 c = c >> 1;
         }
         crc_table[n] = c;
+        crc_slice[0][n] = c;
     }
-    crc_table_computed = 1;
+    for (n = 0; n < 256; n++)
+        for (k = 1; k < 8; k++)
+            crc_slice[k][n] = (crc_slice[k - 1][n] >> 8) ^
+                              crc_slice[0][crc_slice[k - 1][n] & 0xff];
+    /* threads that see the flag see the tables */
+    __atomic_store_n(&crc_table_computed, 1, __ATOMIC_RELEASE);
 }
 
 /* Update a running CRC with the bytes buf[0..len-1]--the CRC
@@ -36,13 +49,26 @@ void make_crc_table(void)
 
 unsigned long update_crc(unsigned long crc, unsigned char *buf, int len)
 {
-    unsigned long c = crc;
-    int n;
+    uint32_t c = (uint32_t) crc;
+    int n = 0;
 
-    if (!crc_table_computed)
+    if (!__atomic_load_n(&crc_table_computed, __ATOMIC_ACQUIRE))
         make_crc_table();
-    for (n = 0; n < len; n++) {
-        c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; n + 8 <= len; n += 8) {
+        uint32_t lo, hi;
+
+        memcpy(&lo, buf + n, 4);
+        memcpy(&hi, buf + n + 4, 4);
+        lo ^= c;
+        c = crc_slice[7][lo & 0xff] ^ crc_slice[6][(lo >> 8) & 0xff] ^
+            crc_slice[5][(lo >> 16) & 0xff] ^ crc_slice[4][lo >> 24] ^
+            crc_slice[3][hi & 0xff] ^ crc_slice[2][(hi >> 8) & 0xff] ^
+            crc_slice[1][(hi >> 16) & 0xff] ^ crc_slice[0][hi >> 24];
+    }
+#endif
+    for (; n < len; n++) {
+        c = crc_slice[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
     }
     return c;
 }
@@ -0,0 +1,121 @@
+/**
+ * @file: evcount.c
+ * @brief: eventcount, futex based waiting on a condition protected by
+ *         someone else's lock, usable across processes in shared memory
+ *
+ * A waiter takes a key with evcount_prepare() while it still holds the
+ * lock and sees the condition false, drops the lock and calls
+ * evcount_wait(). Whoever makes the condition true changes the state under
+ * the lock and then calls evcount_notify(), which moves seq past every key
+ * handed out so far, so a notify between prepare and wait is never lost.
+ *
+ * The waiter spins on seq for a while before parking in the kernel, and
+ * only registers as a waiter once it is about to park, so a notify costs a
+ * system call only when somebody is really asleep. A notify wakes exactly
+ * as many sleepers as it is told.
+ */
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "evcount.h"
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* shared, not FUTEX_PRIVATE_FLAG: waiters are in different processes.
+   timeout is relative, NULL waits forever */
+static long futex(unsigned int *addr, int op, unsigned int val,
+                  struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static long long clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void evcount_init(evcount *ec)
+{
+    ec->seq = 0;
+    ec->waiters = 0;
+}
+
+/**
+ * @brief: take a key to wait with, call with the lock held after finding
+ *         the condition false
+ */
+unsigned int evcount_prepare(evcount *ec)
+{
+    return __atomic_load_n(&ec->seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief: wait until a notify happens after key was taken, without the lock
+ * @param: key unsigned int from evcount_prepare()
+ * @param: spin int times to poll seq before sleeping in the kernel
+ * @param: timeout_ms long longest time to sleep, < 0 for no limit
+ *
+ * @return =0  notified
+ *         <>0 timed out
+ */
+int evcount_wait(evcount *ec, unsigned int key, int spin, long timeout_ms)
+{
+    long long deadline = 0;
+    int ret = 0;
+
+    for (int i = 0; i < spin; i++) {
+        if (__atomic_load_n(&ec->seq, __ATOMIC_ACQUIRE) != key)
+            return 0;
+        cpu_relax();
+    }
+    if (timeout_ms >= 0)
+        deadline = clock_ns() + timeout_ms * 1000000LL;
+    /* seq_cst pairs with evcount_notify(): either it sees the waiter or
+       the waiter sees the new seq */
+    __atomic_add_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ec->seq, __ATOMIC_SEQ_CST) == key) {
+        struct timespec ts;
+        struct timespec *tsp = NULL;
+
+        if (timeout_ms >= 0) {
+            long long left = deadline - clock_ns();
+
+            if (left <= 0) {
+                ret = -1;
+                break;
+            }
+            ts.tv_sec = left / 1000000000LL;
+            ts.tv_nsec = left % 1000000000LL;
+            tsp = &ts;
+        }
+        futex(&ec->seq, FUTEX_WAIT, key, tsp); /* woken, EAGAIN, EINTR or
+                                                  ETIMEDOUT: check again */
+    }
+    __atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+/**
+ * @brief: tell waiters the state changed, call after changing it
+ * @param: n int most sleepers to wake, e.g. the number of items made
+ *         available; <= 0 does nothing
+ */
+void evcount_notify(evcount *ec, int n)
+{
+    if (n <= 0)
+        return;
+    __atomic_add_fetch(&ec->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ec->waiters, __ATOMIC_SEQ_CST) > 0)
+        futex(&ec->seq, FUTEX_WAKE, n < INT_MAX ? n : INT_MAX, NULL);
+}
@@ -0,0 +1,19 @@
+/**
+ * @file: evcount.h
+ * @brief: eventcount, futex based waiting on a condition protected by
+ *         someone else's lock, usable across processes in shared memory
+ */
+
+#pragma once
+
+/* TYPEDEFS */
+typedef struct evcount {
+    unsigned int seq;     /* bumped by every notify, the futex word */
+    unsigned int waiters; /* processes about to sleep or asleep on seq */
+} evcount;
+
+/* FUNCTION PROTOTYPES */
+void evcount_init(evcount *ec);
+unsigned int evcount_prepare(evcount *ec);
+int evcount_wait(evcount *ec, unsigned int key, int spin, long timeout_ms);
+void evcount_notify(evcount *ec, int n);
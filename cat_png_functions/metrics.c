@@ -0,0 +1,288 @@
+/**
+ * @file: metrics.c
+ * @brief: serve live metrics in the Prometheus text format on a local TCP
+ *         port or a Unix socket, and print a summary line on stderr now and
+ *         then, from a background thread
+ *
+ * The thread sleeps in poll() on the listening socket and an eventfd that
+ * stops it, waking up early for the next summary. Every connection gets one
+ * HTTP/1.0 answer with the whole exposition and is closed, which is all a
+ * Prometheus scrape or curl needs; the request itself is not looked at. The
+ * callbacks run on this thread, so what they read has to be safe to read
+ * while the rest of the program changes it (atomics, no locks held).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+/**
+ * @brief: append formatted text to b, growing it as needed
+ */
+void metrics_printf(metrics_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+
+    for (;;) {
+        size_t room = b->cap - b->len;
+        int n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(b->data == NULL ? NULL : b->data + b->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t) n < room) {
+            b->len += n;
+            return;
+        }
+
+        size_t cap = b->cap > 0 ? b->cap * 2 : 4096;
+        char *p;
+
+        while (cap - b->len <= (size_t) n)
+            cap *= 2;
+        p = realloc(b->data, cap);
+        if (p == NULL)
+            return;
+        b->data = p;
+        b->cap = cap;
+    }
+}
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a path (anything with a '/') is a Unix socket, otherwise [host:]port on
+   TCP, host 127.0.0.1 if left out */
+static int listen_on(const char *addr, char *path, size_t path_len)
+{
+    int fd;
+    int one = 1;
+
+    path[0] = '\0';
+    if (strchr(addr, '/') != NULL) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+            listen(fd, 16) != 0) {
+            int err = errno;
+
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        snprintf(path, path_len, "%s", addr);
+        return fd;
+    }
+
+    struct sockaddr_in sin;
+    const char *colon = strrchr(addr, ':');
+    const char *port = colon != NULL ? colon + 1 : addr;
+    char host[64] = "127.0.0.1";
+    char *end;
+    long p = strtol(port, &end, 10);
+
+    if (colon != NULL && colon > addr)
+        snprintf(host, sizeof(host), "%.*s", (int) (colon - addr), addr);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    if (*port == '\0' || *end != '\0' || p < 1 || p > 65535 ||
+        inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    sin.sin_port = htons((unsigned short) p);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0 ||
+        listen(fd, 16) != 0) {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static void send_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+/* answer one connection with the metrics */
+static void serve(metrics_server *m, int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    metrics_buf body = {NULL, 0, 0};
+    char buf[1024];
+    int n;
+
+    /* take the request off the socket, waiting a little for it, so closing
+       doesn't reset the connection before the client has read the answer */
+    if (poll(&pfd, 1, 1000) > 0 && read(fd, buf, sizeof(buf)) < 0) {
+        close(fd);
+        return;
+    }
+    m->expose(&body, m->arg);
+    n = snprintf(buf, sizeof(buf),
+                 "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE
+                 "\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                 body.len);
+    send_all(fd, buf, n);
+    send_all(fd, body.data, body.len);
+    free(body.data);
+    close(fd);
+}
+
+static void *serve_loop(void *arg)
+{
+    metrics_server *m = arg;
+    struct pollfd fds[2] = {{m->wake_fd, POLLIN, 0}, {m->listen_fd, POLLIN, 0}};
+    uint64_t next = clock_ms() + m->summary_ms;
+
+    for (;;) {
+        int timeout = -1;
+
+        if (m->summary_ms > 0) {
+            uint64_t now = clock_ms();
+            timeout = next > now ? (int) (next - now) : 0;
+        }
+        if (poll(fds, m->listen_fd >= 0 ? 2 : 1, timeout) < 0 &&
+            errno != EINTR)
+            break;
+        if (fds[0].revents != 0)
+            break;
+        if (m->listen_fd >= 0 && (fds[1].revents & POLLIN)) {
+            int fd = accept4(m->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd >= 0)
+                serve(m, fd);
+        }
+        if (m->summary_ms > 0 && clock_ms() >= next) {
+            metrics_buf line = {NULL, 0, 0};
+
+            m->summary(&line, m->arg);
+            if (line.len > 0)
+                fwrite(line.data, 1, line.len, stderr);
+            free(line.data);
+            next += m->summary_ms;
+            if (next < clock_ms()) /* fell behind, don't burst */
+                next = clock_ms() + m->summary_ms;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief: start serving metrics in a thread of this process. The thread
+ *         blocks every signal, they stay with the caller.
+ * @param: addr const char* where to listen: a Unix socket path, or
+ *         [host:]port on TCP; NULL for no endpoint
+ * @param: summary_ms long write summary's line on stderr this often,
+ *         0 for never
+ * @param: expose metrics_fn writes the Prometheus text
+ * @param: summary metrics_fn writes one summary line, newline included
+ * @param: arg void* passed to both
+ *
+ * @return 0 on success, an errno value otherwise
+ */
+int metrics_start(metrics_server *m, const char *addr, long summary_ms,
+                  metrics_fn expose, metrics_fn summary, void *arg)
+{
+    sigset_t all, old;
+    int err;
+
+    m->listen_fd = -1;
+    m->wake_fd = -1;
+    m->summary_ms = summary_ms;
+    m->expose = expose;
+    m->summary = summary;
+    m->arg = arg;
+    m->path[0] = '\0';
+    if (addr != NULL &&
+        (m->listen_fd = listen_on(addr, m->path, sizeof(m->path))) < 0)
+        return errno;
+    m->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (m->wake_fd < 0) {
+        err = errno;
+        metrics_stop(m);
+        return err;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&m->thread, NULL, serve_loop, m);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        close(m->wake_fd);
+        m->wake_fd = -1;
+        metrics_stop(m);
+    }
+    return err;
+}
+
+/**
+ * @brief: stop the thread, finishing an answer in progress, and close and
+ *         remove the endpoint
+ */
+void metrics_stop(metrics_server *m)
+{
+    if (m->wake_fd >= 0) {
+        uint64_t one = 1;
+
+        if (write(m->wake_fd, &one, sizeof(one)) == sizeof(one))
+            pthread_join(m->thread, NULL);
+        close(m->wake_fd);
+        m->wake_fd = -1;
+    }
+    if (m->listen_fd >= 0) {
+        close(m->listen_fd);
+        m->listen_fd = -1;
+    }
+    if (m->path[0] != '\0')
+        unlink(m->path);
+    m->path[0] = '\0';
+}
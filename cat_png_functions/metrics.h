@@ -0,0 +1,45 @@
+/**
+ * @file: metrics.h
+ * @brief: serve live metrics in the Prometheus text format on a local TCP
+ *         port or a Unix socket, and print a summary line on stderr now and
+ *         then, from a background thread
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* DEFINES */
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/* TYPEDEFS */
+
+/* text a scrape or a summary is written into, grows as needed */
+typedef struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} metrics_buf;
+
+/* writes the metrics (or the summary line) of arg into out */
+typedef void (*metrics_fn)(metrics_buf *out, void *arg);
+
+/* the serving thread, local to the process that started it */
+typedef struct metrics_server {
+    int listen_fd;    /* -1 without an endpoint */
+    int wake_fd;      /* eventfd, written to stop the thread */
+    long summary_ms;  /* between summaries, 0 for none */
+    metrics_fn expose;
+    metrics_fn summary;
+    void *arg;
+    char path[108];   /* Unix socket to remove at the end, "" for TCP */
+    pthread_t thread;
+} metrics_server;
+
+/* FUNCTION PROTOTYPES */
+void metrics_printf(metrics_buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int metrics_start(metrics_server *m, const char *addr, long summary_ms,
+                  metrics_fn expose, metrics_fn summary, void *arg);
+void metrics_stop(metrics_server *m);
@@ -0,0 +1,153 @@
+/**
+ * @file: perfctr.c
+ * @brief: hardware and software counters of the calling process through
+ *         perf_event_open(2), read around a stretch of code and added up
+ *         per stage in shared memory
+ *
+ * Every event is opened in one group on the calling process (any CPU, not
+ * inherited by children), so one read() returns all of them and they are
+ * scheduled together. Events the CPU or the permissions don't allow are
+ * left out: kernel side counting is tried first and user space only after
+ * that, and a virtual machine without a PMU still gets the software ones.
+ * If the group is multiplexed with other users of the PMU the values are
+ * scaled by how long it was actually counting.
+ *
+ * A stage is timed by taking a sample before it and calling perf_add()
+ * after it, which adds the differences to the stage's totals with atomics,
+ * so any number of processes can add to the same totals.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+static const struct {
+    const char *name;
+    unsigned int type;
+    uint64_t config;
+} events[PERF_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"LLC-misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_event(int event, int group)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[event].type;
+    attr.config = events[event].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                 PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+        /* perf_event_paranoid may only allow user space */
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                     PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/**
+ * @brief: start counting every event that can be counted for this process
+ * @return number of events counted, 0 if none could be
+ */
+int perf_open(perf_counters *pc)
+{
+    pc->leader = -1;
+    pc->count = 0;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        pc->fds[e] = open_event(e, pc->leader);
+        pc->slot[e] = -1;
+        if (pc->fds[e] < 0)
+            continue;
+        if (pc->leader < 0)
+            pc->leader = pc->fds[e];
+        pc->slot[e] = pc->count++;
+    }
+    return pc->count;
+}
+
+void perf_close(perf_counters *pc)
+{
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (pc->fds[e] >= 0)
+            close(pc->fds[e]);
+        pc->fds[e] = -1;
+    }
+    pc->leader = -1;
+    pc->count = 0;
+}
+
+/**
+ * @brief: the counters now, 0 for events not counted
+ */
+void perf_read(perf_counters *pc, perf_sample *s)
+{
+    uint64_t buf[3 + PERF_EVENTS]; /* nr, time enabled, time running, values */
+
+    memset(s, 0, sizeof(*s));
+    s->ns = clock_ns();
+    if (pc->leader < 0 ||
+        read(pc->leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t)))
+        return;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        uint64_t v;
+
+        if (pc->slot[e] < 0 || pc->slot[e] >= (int) buf[0] || buf[2] == 0)
+            continue;
+        v = buf[3 + pc->slot[e]];
+        /* scaled up for the time the group was switched out */
+        s->v[e] = buf[2] < buf[1] ? (uint64_t) ((double) v * buf[1] / buf[2])
+                                  : v;
+    }
+}
+
+/**
+ * @brief: add what the counters moved since start to a stage's totals
+ */
+void perf_add(perf_total *t, perf_counters *pc, const perf_sample *start)
+{
+    perf_sample now;
+    unsigned int have = 0;
+
+    perf_read(pc, &now);
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (pc->slot[e] < 0)
+            continue;
+        have |= 1U << e;
+        if (now.v[e] > start->v[e])
+            __atomic_add_fetch(&t->v[e], now.v[e] - start->v[e],
+                               __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&t->ns, now.ns - start->ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&t->have, have, __ATOMIC_RELAXED);
+}
+
+const char *perf_event_name(int event)
+{
+    return events[event].name;
+}
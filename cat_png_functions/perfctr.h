@@ -0,0 +1,51 @@
+/**
+ * @file: perfctr.h
+ * @brief: hardware and software counters of the calling process through
+ *         perf_event_open(2), read around a stretch of code and added up
+ *         per stage in shared memory
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* DEFINES */
+#define PERF_EVENTS 5 /* counted events, in enum perf_event order */
+
+/* TYPEDEFS */
+enum perf_event {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES, /* last level cache read misses */
+    PERF_CTX_SWITCHES,
+    PERF_PAGE_FAULTS,
+};
+
+/* the counters of one process, one group read with a single read() */
+typedef struct perf_counters {
+    int leader;            /* group fd, -1 when nothing could be opened */
+    int fds[PERF_EVENTS];  /* -1 for events the kernel or CPU won't count */
+    int slot[PERF_EVENTS]; /* position of each event in a group read */
+    int count;             /* events in the group */
+} perf_counters;
+
+/* counter values at one point */
+typedef struct perf_sample {
+    uint64_t v[PERF_EVENTS];
+    uint64_t ns;
+} perf_sample;
+
+/* what one stage cost, summed over every process that ran it */
+typedef struct perf_total {
+    uint64_t v[PERF_EVENTS];
+    uint64_t ns;
+    uint64_t count;    /* times the stage ran */
+    unsigned int have; /* bit per event some process counted */
+} perf_total;
+
+/* FUNCTION PROTOTYPES */
+int perf_open(perf_counters *pc);
+void perf_close(perf_counters *pc);
+void perf_read(perf_counters *pc, perf_sample *s);
+void perf_add(perf_total *t, perf_counters *pc, const perf_sample *start);
+const char *perf_event_name(int event);
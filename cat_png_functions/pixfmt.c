@@ -0,0 +1,152 @@
+/**
+ * @file: pixfmt.c
+ * @brief: the pixel formats fragments may come in, and row copies that turn
+ *         each of them into the 8-bit RGBA of the canvas
+ *
+ * Every format has one copy loop, written once as an always inlined body.
+ * The macros below stamp out a function per format for each of the widths
+ * in WIDTHS, with the width a constant the compiler can unroll and
+ * vectorize for, plus one per format taking any width. pixfmt_row_copy()
+ * picks one from the fragment's IHDR once per fragment, so copying a row is
+ * a single indirect call with no format or width tests in it.
+ */
+
+#include <string.h>
+#include "pixfmt.h"
+
+/* in enum pixfmt order */
+#define FORMATS(X, w) X(rgba8, w) X(rgb8, w) X(gray8, w) X(rgba16, w)
+
+/* widths with copies of their own, the default geometry's first */
+#define WIDTHS(X) X(400) X(256) X(320) X(512) X(640) X(800) X(1024) X(1280) \
+                  X(1920)
+
+static const int bpp[PIXFMT_COUNT] = {4, 3, 1, 8};
+static const char *const names[PIXFMT_COUNT] = {"RGBA8", "RGB8", "GRAY8",
+                                                "RGBA16"};
+
+static inline __attribute__((always_inline))
+void copy_rgba8(U8 *dest, const U8 *src, unsigned int width)
+{
+    memcpy(dest, src, (size_t) width * 4);
+}
+
+static inline __attribute__((always_inline))
+void copy_rgb8(U8 *dest, const U8 *src, unsigned int width)
+{
+    for (unsigned int x = 0; x < width; x++) {
+        dest[4 * x] = src[3 * x];
+        dest[4 * x + 1] = src[3 * x + 1];
+        dest[4 * x + 2] = src[3 * x + 2];
+        dest[4 * x + 3] = 0xff;
+    }
+}
+
+static inline __attribute__((always_inline))
+void copy_gray8(U8 *dest, const U8 *src, unsigned int width)
+{
+    for (unsigned int x = 0; x < width; x++) {
+        dest[4 * x] = src[x];
+        dest[4 * x + 1] = src[x];
+        dest[4 * x + 2] = src[x];
+        dest[4 * x + 3] = 0xff;
+    }
+}
+
+/* samples are big endian, the first byte is the one kept */
+static inline __attribute__((always_inline))
+void copy_rgba16(U8 *dest, const U8 *src, unsigned int width)
+{
+    for (unsigned int i = 0; i < width * 4; i++)
+        dest[i] = src[2 * i];
+}
+
+#define WIDTH_COPY(fmt, w)                                                \
+    static void copy_##fmt##_##w(U8 *dest, const U8 *src,                 \
+                                 unsigned int width)                      \
+    {                                                                     \
+        copy_##fmt(dest, src, w);                                         \
+    }
+#define WIDTH_COPIES(w) FORMATS(WIDTH_COPY, w)
+#define ANY_COPY(fmt, unused)                                             \
+    static void copy_##fmt##_any(U8 *dest, const U8 *src,                 \
+                                 unsigned int width)                      \
+    {                                                                     \
+        copy_##fmt(dest, src, width);                                     \
+    }
+
+WIDTHS(WIDTH_COPIES)
+FORMATS(ANY_COPY, any)
+
+#define COPY_FN(fmt, w) copy_##fmt##_##w,
+#define WIDTH_ENTRY(w) {w, {FORMATS(COPY_FN, w)}},
+
+static const struct {
+    unsigned int width;
+    row_copy_fn copy[PIXFMT_COUNT];
+} by_width[] = {WIDTHS(WIDTH_ENTRY)};
+
+static const row_copy_fn any_width[PIXFMT_COUNT] = {FORMATS(COPY_FN, any)};
+
+/**
+ * @brief: the format of an IHDR's bit depth and color type
+ * @return enum pixfmt, PIXFMT_UNKNOWN if it isn't one of them
+ */
+int pixfmt_from_ihdr(U8 bit_depth, U8 color_type)
+{
+    if (bit_depth == 8 && color_type == 6)
+        return PIXFMT_RGBA8;
+    if (bit_depth == 8 && color_type == 2)
+        return PIXFMT_RGB8;
+    if (bit_depth == 8 && color_type == 0)
+        return PIXFMT_GRAY8;
+    if (bit_depth == 16 && color_type == 6)
+        return PIXFMT_RGBA16;
+    return PIXFMT_UNKNOWN;
+}
+
+/**
+ * @brief: bytes per pixel of a format, also what the scanline filters use
+ */
+int pixfmt_bpp(int fmt)
+{
+    return bpp[fmt];
+}
+
+const char *pixfmt_name(int fmt)
+{
+    return fmt >= 0 && fmt < PIXFMT_COUNT ? names[fmt] : "unknown";
+}
+
+/**
+ * @brief: the row copy for a format, the one made for width if there is one
+ */
+row_copy_fn pixfmt_row_copy(int fmt, unsigned int width)
+{
+    for (size_t i = 0; i < sizeof(by_width) / sizeof(by_width[0]); i++) {
+        if (by_width[i].width == width)
+            return by_width[i].copy[fmt];
+    }
+    return any_width[fmt];
+}
+
+/**
+ * @brief: copy unfiltered scanlines of a format into RGBA8 scanlines
+ * @param: dest U8* first output scanline, filter byte included
+ * @param: dest_stride U64 bytes from one output scanline to the next
+ * @param: scan U8* first input scanline, filter byte included
+ * @param: stride U64 bytes from one input scanline to the next
+ * @param: fmt int enum pixfmt of scan
+ * @param: width unsigned int pixels per row
+ * @param: rows unsigned int scanlines to copy
+ */
+void pixfmt_copy_rows(U8 *dest, U64 dest_stride, U8 *scan, U64 stride,
+                      int fmt, unsigned int width, unsigned int rows)
+{
+    row_copy_fn copy = pixfmt_row_copy(fmt, width);
+
+    for (unsigned int r = 0; r < rows; r++) {
+        dest[r * dest_stride] = 0; /* filter type None */
+        copy(dest + r * dest_stride + 1, scan + r * stride + 1, width);
+    }
+}
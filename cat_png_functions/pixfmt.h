@@ -0,0 +1,32 @@
+/**
+ * @file: pixfmt.h
+ * @brief: the pixel formats fragments may come in, and row copies that turn
+ *         each of them into the 8-bit RGBA of the canvas
+ */
+
+#pragma once
+
+#include "zutil.h"
+
+/* DEFINES */
+#define PIXFMT_UNKNOWN (-1)
+
+/* TYPEDEFS */
+typedef enum pixfmt {
+    PIXFMT_RGBA8,  /* color type 6, bit depth 8 */
+    PIXFMT_RGB8,   /* color type 2, bit depth 8, opaque */
+    PIXFMT_GRAY8,  /* color type 0, bit depth 8, opaque */
+    PIXFMT_RGBA16, /* color type 6, bit depth 16, the high bytes are kept */
+    PIXFMT_COUNT
+} pixfmt;
+
+/* one row of width pixels from src into RGBA8 dest */
+typedef void (*row_copy_fn)(U8 *dest, const U8 *src, unsigned int width);
+
+/* FUNCTION PROTOTYPES */
+int pixfmt_from_ihdr(U8 bit_depth, U8 color_type);
+int pixfmt_bpp(int fmt);
+const char *pixfmt_name(int fmt);
+row_copy_fn pixfmt_row_copy(int fmt, unsigned int width);
+void pixfmt_copy_rows(U8 *dest, U64 dest_stride, U8 *scan, U64 stride,
+                      int fmt, unsigned int width, unsigned int rows);
@@ -1,118 +1,396 @@
+/**
+ * @file: pnginfo.c
+ * @brief: read and validate PNG files, mapping each file once
+ *
+ * png_validate_mem walks every chunk of a PNG in memory, checks lengths,
+ * CRCs and chunk order, and with PNG_CHECK_INFLATE inflates the image data
+ * as it goes, so zlib checks the adler32 and the row count can be compared
+ * with the IHDR. Nothing is copied: the data is read where it lies and
+ * inflated through a fixed size buffer, whatever the image size.
+ * png_validate_file runs it over a read-only mapping of the file.
+ */
+
 #include <sys/types.h>
-#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>  /* for printf().  man 3 printf */
 #include <stdlib.h> /* for exit().    man 3 exit   */
 #include <string.h> /* for strcat().  man strcat   */
-#include <arpa/inet.h>
 #include "crc.h"
+#include "zutil.h"
+#include "pnginfo.h"
 
-unsigned int is_png(char *fileName)
+#define PNG_INFLATE_BUF 65536 // bytes inflated at a time when checking image data
+
+static const unsigned char png_signature[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A}; //png header
+
+static unsigned int get_u32(const unsigned char *p)
 {
-    unsigned char header[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A}; //png header
-    unsigned char buffer[8] = {}; //buffer for file png header
+    return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+}
 
-    FILE *file = fopen(fileName, "rb"); // read file
-    if (file == NULL)
+static int fail(png_report *rep, int error, size_t offset, const unsigned char *type)
+{
+    rep->error = error;
+    rep->offset = offset;
+    if (type != NULL)
     {
-        printf("bad file\n");
+        memcpy(rep->chunk, type, 4);
+        rep->chunk[4] = '\0';
+    }
+    return error;
+}
+
+// bytes of one row of w pixels, without the filter byte; 0 for an unknown color type or depth
+static unsigned long long row_bytes(const png_report *rep, unsigned long long w)
+{
+    int channels;
+    switch (rep->color_type)
+    {
+    case 0: // gray, one channel if the depth is allowed
+        channels = rep->bit_depth == 1 || rep->bit_depth == 2 || rep->bit_depth == 4 || rep->bit_depth == 8 ||
+                   rep->bit_depth == 16;
+        break;
+    case 3: // palette, the same
+        channels = rep->bit_depth == 1 || rep->bit_depth == 2 || rep->bit_depth == 4 || rep->bit_depth == 8;
+        break;
+    case 2: // RGB
+        channels = 3;
+        break;
+    case 4: // gray and alpha
+        channels = 2;
+        break;
+    case 6: // RGBA
+        channels = 4;
+        break;
+    default:
         return 0;
     }
-    else
+    if (rep->color_type == 2 || rep->color_type == 4 || rep->color_type == 6)
+    {
+        channels = rep->bit_depth == 8 || rep->bit_depth == 16 ? channels : 0;
+    }
+    return (w * channels * rep->bit_depth + 7) / 8;
+}
+
+// inflated size of the image data the IHDR describes, filter bytes included
+static unsigned long long raw_size(const png_report *rep)
+{
+    static const int x0[7] = {0, 4, 0, 2, 0, 1, 0}, y0[7] = {0, 0, 4, 0, 2, 0, 1};
+    static const int dx[7] = {8, 8, 4, 4, 2, 2, 1}, dy[7] = {8, 8, 8, 4, 4, 2, 2};
+    unsigned long long total = 0;
+
+    if (!rep->interlace)
     {
-        fread(buffer, 8, 1, file);
-        fclose(file);
-        for (int i = 0; i < 8; i++)
+        return rep->height * (1 + row_bytes(rep, rep->width));
+    }
+    for (int p = 0; p < 7; p++) // Adam7: each pass is an image of its own
+    {
+        unsigned long long w = rep->width > (unsigned)x0[p] ? (rep->width - x0[p] + dx[p] - 1) / dx[p] : 0;
+        unsigned long long h = rep->height > (unsigned)y0[p] ? (rep->height - y0[p] + dy[p] - 1) / dy[p] : 0;
+        if (w > 0 && h > 0)
         {
-            if (header[i] != buffer[i])
-            { // doesn't match header, not png
-                return 0;
-            }
+            total += h * (1 + row_bytes(rep, w));
         }
+    }
+    return total;
+}
+
+static int check_ihdr(png_report *rep, const unsigned char *data, unsigned int len)
+{
+    if (len != 13)
+    {
         return 1;
     }
+    rep->width = get_u32(data);
+    rep->height = get_u32(data + 4);
+    rep->bit_depth = data[8];
+    rep->color_type = data[9];
+    rep->interlace = data[12];
+    return rep->width == 0 || rep->width > 0x7fffffffU || rep->height == 0 || rep->height > 0x7fffffffU ||
+           row_bytes(rep, 1) == 0 || data[10] != 0 || data[11] != 0 || rep->interlace > 1;
 }
 
-unsigned int png_height(char *fileName)
+/**
+ * @brief: validate a PNG held in memory
+ * @param: flags int PNG_CHECK_INFLATE to inflate the image data too
+ * @param: rep png_report* filled with what was found, and the first error
+ * @return PNG_OK or the PNG_E_* error, also in rep->error
+ */
+int png_validate_mem(const unsigned char *buf, size_t len, int flags, png_report *rep)
 {
+    z_stream strm;
+    unsigned char *out = NULL;
+    int idat_run = 0; // 0 before the IDAT chunks, 1 in them, 2 after them
+    int zret = Z_OK;
+    int iend = 0;
+    size_t pos = 8;
 
-    unsigned int height;
+    memset(rep, 0, sizeof(*rep));
+    if (len < 8 || memcmp(buf, png_signature, 8) != 0)
+    {
+        return fail(rep, PNG_E_SIGNATURE, 0, NULL);
+    }
+    if (flags & PNG_CHECK_INFLATE)
+    {
+        memset(&strm, 0, sizeof(strm));
+        out = malloc(PNG_INFLATE_BUF);
+        if (out == NULL || inflateInit(&strm) != Z_OK)
+        {
+            free(out);
+            return fail(rep, PNG_E_ZLIB, 0, NULL);
+        }
+    }
 
-    FILE *file = fopen(fileName, "rb"); // read file
-    if (file == NULL)
+    while (pos < len && rep->error == PNG_OK)
     {
-        printf("bad file");
-        return 0;
+        if (iend)
+        {
+            fail(rep, PNG_E_IEND, pos, NULL);
+            break;
+        }
+        if (len - pos < 12)
+        {
+            fail(rep, PNG_E_TRUNCATED, pos, NULL);
+            break;
+        }
+        unsigned int clen = get_u32(buf + pos);
+        const unsigned char *type = buf + pos + 4;
+        const unsigned char *data = buf + pos + 8;
+        if (clen > 0x7fffffffU)
+        {
+            fail(rep, PNG_E_LENGTH, pos, type);
+            break;
+        }
+        if (clen > len - pos - 12)
+        {
+            fail(rep, PNG_E_TRUNCATED, pos, type);
+            break;
+        }
+        // type and data, in two goes as the sum may not fit an int
+        unsigned long c = update_crc(0xffffffffL, (unsigned char *)type, 4);
+        c = update_crc(c, (unsigned char *)data, (int)clen) ^ 0xffffffffL;
+        if (c != get_u32(data + clen))
+        {
+            fail(rep, PNG_E_CRC, pos, type);
+            break;
+        }
+
+        int is_ihdr = memcmp(type, "IHDR", 4) == 0;
+        if ((rep->chunks == 0) != is_ihdr || (is_ihdr && check_ihdr(rep, data, clen)))
+        {
+            fail(rep, PNG_E_IHDR, pos, type);
+        }
+        else if (memcmp(type, "IDAT", 4) == 0)
+        {
+            if (idat_run == 2)
+            {
+                fail(rep, PNG_E_ORDER, pos, type);
+            }
+            idat_run = 1;
+            rep->idat_len += clen;
+            if (out != NULL && rep->error == PNG_OK)
+            {
+                strm.next_in = (unsigned char *)data;
+                strm.avail_in = clen;
+                // until the chunk is used up and no output is left pending
+                while (zret == Z_OK && (strm.avail_in > 0 || strm.avail_out == 0))
+                {
+                    strm.next_out = out;
+                    strm.avail_out = PNG_INFLATE_BUF;
+                    zret = inflate(&strm, Z_NO_FLUSH);
+                    rep->raw_len += PNG_INFLATE_BUF - strm.avail_out;
+                }
+                if (zret == Z_BUF_ERROR)
+                {
+                    zret = Z_OK; // nothing more without the next chunk
+                }
+                // an error, or data left over after the end of the stream
+                if ((zret != Z_OK && zret != Z_STREAM_END) || strm.avail_in > 0)
+                {
+                    fail(rep, PNG_E_ZLIB, pos, type);
+                }
+            }
+        }
+        else
+        {
+            idat_run = idat_run ? 2 : 0;
+            if (memcmp(type, "IEND", 4) == 0)
+            {
+                iend = 1;
+                if (clen != 0)
+                {
+                    fail(rep, PNG_E_IEND, pos, type);
+                }
+            }
+        }
+        rep->chunks++;
+        pos += 12 + (size_t)clen;
+    }
+
+    if (rep->error == PNG_OK && rep->chunks == 0)
+    {
+        fail(rep, PNG_E_IHDR, pos, NULL);
+    }
+    else if (rep->error == PNG_OK && idat_run == 0)
+    {
+        fail(rep, PNG_E_ORDER, pos, NULL);
     }
-    else
+    else if (rep->error == PNG_OK && !iend)
     {
-        fseek(file, 20, SEEK_SET); //skip over everything to height from IHDR
-        fread(&height, 4, 1, file);
-        fclose(file);
-        height = ntohl(height); //conversion
-        return height;
+        fail(rep, PNG_E_IEND, pos, NULL);
+    }
+    if (out != NULL)
+    {
+        if (rep->error == PNG_OK && zret != Z_STREAM_END)
+        {
+            fail(rep, PNG_E_ZLIB, pos, NULL); // the stream stops short
+        }
+        else if (rep->error == PNG_OK && rep->raw_len != raw_size(rep))
+        {
+            fail(rep, PNG_E_SIZE, pos, NULL);
+        }
+        inflateEnd(&strm);
+        free(out);
     }
+    return rep->error;
 }
 
-unsigned int png_width(char *fileName)
+// map a whole file read only; an empty file gives a non-NULL pointer and *len 0
+static const unsigned char *map_file(const char *path, size_t *len)
+{
+    static const unsigned char empty[1];
+    struct stat st;
+    void *p;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    *len = st.st_size;
+    if (*len == 0)
+    {
+        close(fd);
+        return empty;
+    }
+    p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd); // the mapping keeps the file
+    if (p == MAP_FAILED)
+    {
+        errno = err;
+        return NULL;
+    }
+    madvise(p, *len, MADV_SEQUENTIAL);
+    return p;
+}
+
+static void unmap_file(const unsigned char *p, size_t len)
 {
+    if (len > 0)
+    {
+        munmap((void *)p, len);
+    }
+}
 
-    unsigned int width;
+/**
+ * @brief: validate a PNG file, see png_validate_mem
+ * @return PNG_OK, PNG_E_OPEN with the reason in rep->sys_errno, or the
+ *         PNG_E_* error
+ */
+int png_validate_file(const char *path, int flags, png_report *rep)
+{
+    size_t len = 0;
+    const unsigned char *p = map_file(path, &len);
 
-    FILE *file = fopen(fileName, "rb"); // read file
-    if (file == NULL)
+    if (p == NULL)
     {
-        printf("bad file");
+        memset(rep, 0, sizeof(*rep));
+        rep->sys_errno = errno;
+        return fail(rep, PNG_E_OPEN, 0, NULL);
+    }
+    png_validate_mem(p, len, flags, rep);
+    unmap_file(p, len);
+    return rep->error;
+}
+
+const char *png_strerror(int error)
+{
+    static const char *msgs[] = {
+        "ok",
+        "can't open file",
+        "not a PNG signature",
+        "chunk runs past the end of the file",
+        "chunk length over 2^31 - 1",
+        "CRC mismatch",
+        "bad or missing IHDR",
+        "IDAT chunks missing or not consecutive",
+        "missing IEND or data after it",
+        "image data doesn't inflate or fails its adler32",
+        "image data size doesn't match the IHDR",
+    };
+    return error >= 0 && error < (int)(sizeof(msgs) / sizeof(msgs[0])) ? msgs[error] : "unknown error";
+}
+
+unsigned int is_png(char *fileName)
+{
+    size_t len = 0;
+    const unsigned char *p = map_file(fileName, &len);
+    if (p == NULL)
+    {
+        printf("bad file\n");
         return 0;
     }
-    else
+    int match = len >= 8 && memcmp(p, png_signature, 8) == 0;
+    unmap_file(p, len);
+    return match;
+}
+
+// IHDR field at offset off of the file, 0 if it's too short
+static unsigned int ihdr_field(char *fileName, size_t off)
+{
+    size_t len = 0;
+    const unsigned char *p = map_file(fileName, &len);
+    if (p == NULL)
     {
-        fseek(file, 16, SEEK_SET); // move 8 bytes after reading for IHDR
-        fread(&width, 4, 1, file); // copy to address directly
-        fclose(file);
-        width = ntohl(width);
-        return width;
+        printf("bad file");
+        return 0;
     }
+    unsigned int value = len >= off + 4 ? get_u32(p + off) : 0;
+    unmap_file(p, len);
+    return value;
+}
+
+unsigned int png_height(char *fileName)
+{
+    return ihdr_field(fileName, 20); //skip over everything to height from IHDR
+}
+
+unsigned int png_width(char *fileName)
+{
+    return ihdr_field(fileName, 16); // 8 bytes after signature and IHDR length and type
 }
 
 unsigned int check_corrupt(char *fileName)
 { // returns 1 if corrupt, 0 if not corrupt
-    FILE *file = fopen(fileName, "rb");
-    if (file == NULL)
+    png_report rep;
+    int error = png_validate_file(fileName, 0, &rep);
+    if (error == PNG_E_OPEN)
     {
         printf("bad file\n");
         return 0;
     }
-    else
-    {
-        //IHDR Chunk
-        fseek(file, 12, SEEK_SET); //skip 12 to IHDR type byte
-        unsigned char IHDR_Buf [17];
-        fread(IHDR_Buf, 17, 1, file); //read IHDR type and data chunk
-        unsigned int IHDR_Actual; //for actual crc
-        fread(&IHDR_Actual, 4, 1, file);
-        IHDR_Actual = ntohl(IHDR_Actual);
-        unsigned long IHDR_calc_crc = crc(IHDR_Buf, 17); //calculate crc
-        if (IHDR_Actual != IHDR_calc_crc) {
-            return 1;
-        }
-
-        int data;
-        fread(&data, 4, 1, file);
-        data = ntohl(data); //data length of IDAT
-        data += 4;
-        unsigned char IDAT_Buf[data];
-        fread(IDAT_Buf, data, 1, file); //read IDAT type and data
-        unsigned long IDAT_calc_crc = crc(IDAT_Buf, data);
-        unsigned int IDAT_actual;
-        fread(&IDAT_actual, 4, 1, file); //actual crc of IDAT
-        fclose(file);
-        IDAT_actual = ntohl(IDAT_actual);
-        if (IDAT_actual == IDAT_calc_crc) {
-            return 0;
-        } else {
-            return 1;
-        }
-    }
-}
\ No newline at end of file
+    // every chunk's CRC, not just the IHDR and first IDAT
+    return error != PNG_OK;
+}
@@ -1,3 +1,50 @@
+/**
+ * @file: pnginfo.h
+ * @brief: read and validate PNG files, mapping each file once
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* DEFINES */
+#define PNG_CHECK_INFLATE 1 /* also inflate the image data */
+
+/* what png_validate found wrong, PNG_OK if nothing */
+#define PNG_OK          0
+#define PNG_E_OPEN      1 /* can't open or map the file, see errno */
+#define PNG_E_SIGNATURE 2
+#define PNG_E_TRUNCATED 3 /* a chunk runs past the end of the file */
+#define PNG_E_LENGTH    4 /* chunk length over 2^31 - 1 */
+#define PNG_E_CRC       5
+#define PNG_E_IHDR      6 /* missing, not first, or with bad fields */
+#define PNG_E_ORDER     7 /* IDAT chunks missing or not consecutive */
+#define PNG_E_IEND      8 /* missing, or data after it */
+#define PNG_E_ZLIB      9 /* image data doesn't inflate, or its adler32 is wrong */
+#define PNG_E_SIZE      10 /* image data isn't height rows of width pixels */
+
+/* TYPEDEFS */
+typedef struct png_report {
+    unsigned int width;
+    unsigned int height;
+    int bit_depth;
+    int color_type;
+    int interlace;
+    int chunks;              /* chunks walked */
+    unsigned long idat_len;  /* compressed image data bytes */
+    unsigned long raw_len;   /* inflated bytes, with PNG_CHECK_INFLATE */
+    int error;               /* PNG_OK or PNG_E_* */
+    size_t offset;           /* of the chunk the error was found in */
+    char chunk[5];           /* type of that chunk, "" if none */
+    int sys_errno;           /* why the file couldn't be read, PNG_E_OPEN only */
+} png_report;
+
+/* FUNCTION PROTOTYPES */
+int png_validate_mem(const unsigned char *buf, size_t len, int flags,
+                     png_report *rep);
+int png_validate_file(const char *path, int flags, png_report *rep);
+const char *png_strerror(int error);
+
 unsigned int is_png(char *fileName); //return 1 if png, 0 if not
 
 unsigned int png_height(char *fileName);
@@ -5,4 +52,3 @@ unsigned int png_height(char *fileName);
 unsigned int png_width(char *fileName);
 
 unsigned int check_corrupt(char *fileName); //return 1 if corrupt, 0 if not
-
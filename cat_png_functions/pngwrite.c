@@ -0,0 +1,323 @@
+/**
+ * @file: pngwrite.c
+ * @brief: write a complete PNG file from already deflated IDAT data
+ *
+ * The whole file is described by one iovec list (signature, IHDR, every
+ * IDAT chunk, IEND) and written with writev() into a file preallocated to
+ * its final size. Chunk CRCs are computed over the caller's IDAT buffer in
+ * place, no copy of the compressed data is made.
+ *
+ * The png_stream functions write the signature and IHDR first and then
+ * emit IDAT chunks as filtered rows are fed to them, for output going to a
+ * pipe or socket before the whole image is known.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "crc.h"
+#include "pngwrite.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static const U8 png_sig[PNG_SIG_LEN] = {0x89, 0x50, 0x4E, 0x47,
+                                        0x0D, 0x0A, 0x1A, 0x0A};
+
+/* CRC of a chunk's type and data, data is read where it is */
+static unsigned int chunk_crc(const char *type, U8 *data, U64 len)
+{
+    unsigned long c = update_crc(0xffffffffL, (unsigned char *) type, 4);
+    c = update_crc(c, data, (int) len); /* len <= PNG_CHUNK_MAX */
+    return (unsigned int) (c ^ 0xffffffffL);
+}
+
+/* length and type fields of a chunk header */
+static void chunk_head(U8 *p, const char *type, U64 len)
+{
+    unsigned int n = htonl((unsigned int) len);
+    memcpy(p, &n, 4);
+    memcpy(p + 4, type, 4);
+}
+
+static void put_u32(U8 *p, unsigned int v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+/* write all of iov, restarting after short writes and signals */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (n > 0) {
+            iov->iov_base = (U8 *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* signature and IHDR chunk, head must hold PNG_SIG_LEN + 25 bytes */
+static void png_head(U8 *head, png_ihdr *ihdr)
+{
+    memcpy(head, png_sig, PNG_SIG_LEN);
+    chunk_head(head + 8, "IHDR", PNG_IHDR_LEN);
+    put_u32(head + 16, ihdr->width);
+    put_u32(head + 20, ihdr->height);
+    head[24] = ihdr->bit_depth;
+    head[25] = ihdr->color_type;
+    head[26] = 0; /* compression: deflate */
+    head[27] = 0; /* filter method: adaptive */
+    head[28] = 0; /* no interlace */
+    put_u32(head + 29, chunk_crc("IHDR", head + 16, PNG_IHDR_LEN));
+}
+
+/* IEND chunk, 12 bytes */
+static void png_tail(U8 *iend)
+{
+    chunk_head(iend, "IEND", 0);
+    put_u32(iend + 8, chunk_crc("IEND", NULL, 0));
+}
+
+/**
+ * @brief: write signature, IHDR, IDAT chunk(s) and IEND to an open file
+ *         descriptor in one pass, leaving it open. Regular files are
+ *         preallocated first.
+ * @param: fd int output descriptor
+ * @param: ihdr png_ihdr* image header fields, no interlacing
+ * @param: idat U8* zlib stream of the filtered scanlines
+ * @param: idat_len U64 length of idat in bytes
+ * @param: chunk_size U64 max data bytes per IDAT chunk, 0 for a single
+ *         chunk (still split at PNG_CHUNK_MAX)
+ *
+ * @return =0  on success
+ *         <>0 on error, errno is set
+ */
+int png_write_fd(int fd, png_ihdr *ihdr, U8 *idat, U64 idat_len,
+                 U64 chunk_size)
+{
+    U8 head[PNG_SIG_LEN + 8 + PNG_IHDR_LEN + 4]; /* signature and IHDR */
+    U8 iend[12];
+    U8 *meta = NULL;          /* 8 header + 4 crc bytes per IDAT chunk */
+    struct iovec *iov = NULL;
+    struct stat st;
+    U64 nchunks;
+    U64 total;
+    int iovcnt = 0;
+    int ret = -1;
+
+    if (chunk_size == 0 || chunk_size > PNG_CHUNK_MAX)
+        chunk_size = PNG_CHUNK_MAX;
+    nchunks = idat_len == 0 ? 1 : (idat_len + chunk_size - 1) / chunk_size;
+
+    png_head(head, ihdr);
+    png_tail(iend);
+
+    meta = malloc(nchunks * 12);
+    iov = malloc((nchunks * 3 + 2) * sizeof(struct iovec));
+    if (meta == NULL || iov == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    iov[iovcnt].iov_base = head;
+    iov[iovcnt++].iov_len = sizeof(head);
+    for (U64 i = 0; i < nchunks; i++) {
+        U64 off = i * chunk_size;
+        U64 len = idat_len - off < chunk_size ? idat_len - off : chunk_size;
+        U8 *m = meta + i * 12;
+
+        chunk_head(m, "IDAT", len);
+        put_u32(m + 8, chunk_crc("IDAT", idat + off, len));
+        iov[iovcnt].iov_base = m;
+        iov[iovcnt++].iov_len = 8;
+        iov[iovcnt].iov_base = idat + off;
+        iov[iovcnt++].iov_len = len;
+        iov[iovcnt].iov_base = m + 8;
+        iov[iovcnt++].iov_len = 4;
+    }
+    iov[iovcnt].iov_base = iend;
+    iov[iovcnt++].iov_len = sizeof(iend);
+    total = sizeof(head) + nchunks * 12 + idat_len + sizeof(iend);
+
+    /* reserve the blocks up front, not every file system supports it */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        fallocate(fd, 0, lseek(fd, 0, SEEK_CUR), total) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        goto out;
+    }
+    ret = writev_all(fd, iov, iovcnt);
+
+out:
+    free(meta);
+    free(iov);
+    return ret;
+}
+
+/* write the pending compressed bytes of ps as one IDAT chunk */
+static int stream_emit(png_stream *ps)
+{
+    U64 len = ps->chunk_size - ps->strm.avail_out;
+    U8 hdr[8];
+    U8 crc[4];
+    struct iovec iov[3];
+
+    if (len == 0)
+        return 0;
+    chunk_head(hdr, "IDAT", len);
+    put_u32(crc, chunk_crc("IDAT", ps->out, len));
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = ps->out;
+    iov[1].iov_len = len;
+    iov[2].iov_base = crc;
+    iov[2].iov_len = 4;
+    if (writev_all(ps->fd, iov, 3) != 0)
+        return -1;
+    ps->idat_count++;
+    ps->strm.next_out = ps->out;
+    ps->strm.avail_out = ps->chunk_size;
+    return 0;
+}
+
+/* run deflate with the given flush mode until it needs more input,
+   writing an IDAT chunk every time the output buffer fills up */
+static int stream_deflate(png_stream *ps, int flush)
+{
+    int ret;
+
+    do {
+        ret = deflate(&ps->strm, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        if (ps->strm.avail_out == 0 && stream_emit(ps) != 0)
+            return -1;
+    } while (ps->strm.avail_in > 0 ||
+             (flush != Z_NO_FLUSH && ps->strm.avail_out == 0) ||
+             (flush == Z_FINISH && ret != Z_STREAM_END));
+    return 0;
+}
+
+/**
+ * @brief: start a PNG stream on fd, the signature and IHDR are written
+ *         immediately
+ * @param: ps png_stream* stream state, caller supplies
+ * @param: fd int file descriptor to write to, not closed by the stream
+ * @param: ihdr png_ihdr* image header fields
+ * @param: level int zlib compression level
+ * @param: chunk_size U64 IDAT data length, 0 for PNG_STREAM_CHUNK
+ *
+ * @return =0  on success
+ *         <>0 on error
+ */
+int png_stream_open(png_stream *ps, int fd, png_ihdr *ihdr, int level,
+                    U64 chunk_size)
+{
+    U8 head[PNG_SIG_LEN + 8 + PNG_IHDR_LEN + 4];
+    struct iovec iov;
+
+    if (chunk_size == 0 || chunk_size > PNG_CHUNK_MAX)
+        chunk_size = PNG_STREAM_CHUNK;
+    memset(ps, 0, sizeof(*ps));
+    ps->fd = fd;
+    ps->chunk_size = chunk_size;
+    ps->out = malloc(chunk_size);
+    if (ps->out == NULL)
+        return -1;
+    if (deflateInit(&ps->strm, level) != Z_OK) {
+        free(ps->out);
+        return -1;
+    }
+    ps->strm.next_out = ps->out;
+    ps->strm.avail_out = chunk_size;
+
+    png_head(head, ihdr);
+    iov.iov_base = head;
+    iov.iov_len = sizeof(head);
+    if (writev_all(fd, &iov, 1) != 0) {
+        (void) deflateEnd(&ps->strm);
+        free(ps->out);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: compress the next filtered scanlines of the image
+ * @param: ps png_stream* stream from png_stream_open()
+ * @param: scan U8* filtered scanlines, filter bytes included
+ * @param: len U64 length of scan in bytes
+ * @param: flush int non zero to write out everything compressed so far,
+ *         so a reader can decode these rows without waiting for more
+ *
+ * @return =0  on success
+ *         <>0 on error
+ */
+int png_stream_rows(png_stream *ps, U8 *scan, U64 len, int flush)
+{
+    ps->strm.next_in = scan;
+    /* avail_in is a 32-bit uInt, larger inputs go in in slices */
+    do {
+        U64 slice = len > UINT_MAX ? UINT_MAX : len;
+
+        ps->strm.avail_in = slice;
+        len -= slice;
+        if (stream_deflate(ps, len == 0 && flush ? Z_SYNC_FLUSH
+                                                  : Z_NO_FLUSH) != 0)
+            return -1;
+    } while (len > 0);
+    if (flush)
+        return stream_emit(ps);
+    return 0;
+}
+
+/**
+ * @brief: finish the zlib stream, write the last IDAT chunk and IEND and
+ *         release the stream. The file descriptor is left open.
+ *
+ * @return =0  on success
+ *         <>0 on error
+ */
+int png_stream_close(png_stream *ps)
+{
+    U8 iend[12];
+    struct iovec iov;
+    int ret;
+
+    ps->strm.next_in = NULL;
+    ps->strm.avail_in = 0;
+    ret = stream_deflate(ps, Z_FINISH);
+    if (ret == 0)
+        ret = stream_emit(ps);
+    (void) deflateEnd(&ps->strm);
+    free(ps->out);
+    ps->out = NULL;
+    if (ret != 0)
+        return ret;
+
+    png_tail(iend);
+    iov.iov_base = iend;
+    iov.iov_len = sizeof(iend);
+    return writev_all(ps->fd, &iov, 1);
+}
@@ -0,0 +1,39 @@
+/**
+ * @file: pngwrite.h
+ * @brief: write a complete PNG file from already deflated IDAT data
+ */
+
+#pragma once
+
+#include "zutil.h"
+
+/* DEFINES */
+#define PNG_SIG_LEN      8
+#define PNG_IHDR_LEN     13
+#define PNG_CHUNK_MAX    0x7fffffffUL /* largest chunk data length allowed */
+#define PNG_STREAM_CHUNK 65536        /* default IDAT size when streaming */
+
+/* TYPEDEFS */
+typedef struct png_ihdr {
+    unsigned int width;
+    unsigned int height;
+    U8 bit_depth;
+    U8 color_type;
+} png_ihdr;
+
+/* an IDAT stream being written to a file descriptor as rows arrive */
+typedef struct png_stream {
+    int fd;
+    z_stream strm;
+    U8 *out;        /* compressed bytes not yet written as an IDAT chunk */
+    U64 chunk_size; /* capacity of out, also the max IDAT data length */
+    U64 idat_count; /* IDAT chunks written so far */
+} png_stream;
+
+/* FUNCTION PROTOTYPES */
+int png_write_fd(int fd, png_ihdr *ihdr, U8 *idat, U64 idat_len,
+                 U64 chunk_size);
+int png_stream_open(png_stream *ps, int fd, png_ihdr *ihdr, int level,
+                    U64 chunk_size);
+int png_stream_rows(png_stream *ps, U8 *scan, U64 len, int flush);
+int png_stream_close(png_stream *ps);
@@ -0,0 +1,254 @@
+/**
+ * @file: pyramid.c
+ * @brief: 2x, 4x, 8x ... box filtered copies of an 8-bit RGBA image,
+ *         built and written as PNGs while its rows arrive top to bottom
+ *
+ * Every level keeps one row of the level above it. When the second row of
+ * a pair arrives, each 2x2 block of the pair is averaged into one pixel,
+ * the new row is filtered and streamed into the level's PNG right away and
+ * then passed down to the next level. Only a few rows per level are ever
+ * held, so the copies cost no second pass over the full image. An odd last
+ * row or column is averaged with itself.
+ *
+ * The averaging runs 4 output pixels at a time with SSE2 where the compiler
+ * targets it (every x86-64), in portable C otherwise.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "scanline.h"
+#include "pyramid.h"
+
+/**
+ * @brief: average 2x2 blocks of two RGBA rows into one row, rounding to
+ *         nearest
+ * @param: dest U8* (width + 1) / 2 pixels
+ * @param: a U8* upper row, width pixels
+ * @param: b U8* lower row, width pixels
+ * @param: width unsigned int pixels in a and b
+ */
+void pyramid_downscale_row(U8 *dest, U8 *a, U8 *b, unsigned int width)
+{
+    unsigned int half = width / 2;
+    unsigned int x = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i two = _mm_set1_epi16(2);
+
+    for (; x + 4 <= half; x += 4) {
+        __m128i a0 = _mm_loadu_si128((__m128i *) (a + 8 * x));
+        __m128i a1 = _mm_loadu_si128((__m128i *) (a + 8 * x + 16));
+        __m128i b0 = _mm_loadu_si128((__m128i *) (b + 8 * x));
+        __m128i b1 = _mm_loadu_si128((__m128i *) (b + 8 * x + 16));
+        /* columns summed on 16-bit lanes, two pixels per register */
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                                   _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                                   _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                                   _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                                   _mm_unpackhi_epi8(b1, zero));
+        /* then each pixel with its right neighbour */
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+                                   _mm_unpackhi_epi64(s0, s1));
+        __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+                                   _mm_unpackhi_epi64(s2, s3));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i *) (dest + 4 * x),
+                         _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; x < half; x++) {
+        for (int c = 0; c < 4; c++) {
+            dest[4 * x + c] = (a[8 * x + c] + a[8 * x + 4 + c] +
+                               b[8 * x + c] + b[8 * x + 4 + c] + 2) >> 2;
+        }
+    }
+    if (width % 2) {
+        for (int c = 0; c < 4; c++) {
+            dest[4 * half + c] = (a[8 * half + c] + b[8 * half + c] + 1) >> 1;
+        }
+    }
+}
+
+/* free what open made for the first count levels, closing their files */
+static int release(pyramid *p, int count)
+{
+    int status = 0;
+
+    for (int i = 0; i < count; i++) {
+        pyr_level *l = &p->level[i];
+
+        if (png_stream_close(&l->ps) != 0)
+            status = -1;
+        if (close(l->fd) != 0)
+            status = -1;
+        free(l->pending);
+        free(l->row);
+        free(l->prev);
+        free(l->filtered);
+    }
+    p->levels = 0;
+    return status;
+}
+
+/**
+ * @brief: create the PNG of every level and write their headers
+ * @param: p pyramid* state to set up
+ * @param: width unsigned int pixels per row of the full size image
+ * @param: height unsigned int rows of the full size image
+ * @param: levels int copies to make, 1 to PYR_MAX_LEVELS, each half the
+ *         size of the one before
+ * @param: paths char** file for each level, created or truncated
+ * @param: chunk_size U64 max data bytes per IDAT chunk
+ *
+ * @return =0  on success
+ *         <>0 on error, errno is set and no file is left open
+ */
+int pyramid_open(pyramid *p, unsigned int width, unsigned int height,
+                 int levels, char **paths, U64 chunk_size)
+{
+    unsigned int w = width;
+    unsigned int h = height;
+
+    if (levels < 1 || levels > PYR_MAX_LEVELS) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(p, 0, sizeof(*p));
+    p->width = width;
+    p->height = height;
+    for (int i = 0; i < levels; i++) {
+        pyr_level *l = &p->level[i];
+        U64 rowbytes;
+        png_ihdr ihdr;
+        int err;
+
+        l->pending = malloc((U64) w * 4); /* a row of the level above */
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        rowbytes = (U64) w * 4;
+        l->width = w;
+        l->height = h;
+        l->row = malloc(rowbytes + 1);
+        l->prev = malloc(rowbytes);
+        l->filtered = malloc(rowbytes + 1);
+        l->fd = -1;
+        ihdr = (png_ihdr) {w, h, 8, 6};
+        if (l->pending == NULL || l->row == NULL || l->prev == NULL ||
+            l->filtered == NULL)
+            errno = ENOMEM;
+        else if ((l->fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC,
+                               0644)) >= 0 &&
+                 png_stream_open(&l->ps, l->fd, &ihdr, -1, chunk_size) == 0)
+            continue;
+        err = errno;
+        if (l->fd >= 0)
+            close(l->fd);
+        free(l->pending);
+        free(l->row);
+        free(l->prev);
+        free(l->filtered);
+        release(p, i);
+        errno = err;
+        return -1;
+    }
+    p->levels = levels;
+    return 0;
+}
+
+static int feed(pyramid *p, int i, U8 *pixels);
+
+/* average rows a and b of the level above into a row of level i, write it
+   and pass it down */
+static int make_row(pyramid *p, int i, U8 *a, U8 *b)
+{
+    pyr_level *l = &p->level[i];
+    unsigned int above = i == 0 ? p->width : p->level[i - 1].width;
+    U64 rowbytes = (U64) l->width * 4;
+
+    pyramid_downscale_row(l->row + 1, a, b, above);
+    if (png_filter_rows(l->filtered, l->row, l->rows_out > 0 ? l->prev : NULL,
+                        1, rowbytes, 4, PNG_FILTER_ADAPTIVE) != 0 ||
+        png_stream_rows(&l->ps, l->filtered, rowbytes + 1, 0) != 0)
+        return -1;
+    memcpy(l->prev, l->row + 1, rowbytes);
+    l->rows_out++;
+    return feed(p, i + 1, l->row + 1);
+}
+
+/* a row of the level above level i arrives */
+static int feed(pyramid *p, int i, U8 *pixels)
+{
+    pyr_level *l;
+    unsigned int above = i == 0 ? p->width : p->level[i - 1].width;
+
+    if (i == p->levels)
+        return 0;
+    l = &p->level[i];
+    if (l->rows_in++ % 2 == 0) {
+        memcpy(l->pending, pixels, (U64) above * 4);
+        return 0;
+    }
+    return make_row(p, i, l->pending, pixels);
+}
+
+/**
+ * @brief: feed the next rows of the full size image, top to bottom. Rows
+ *         past the height are ignored.
+ * @param: pixels U8* first pixel of the first row, no filter byte
+ * @param: stride U64 bytes from one row to the next
+ * @param: rows unsigned int rows to feed
+ *
+ * @return =0  on success
+ *         <>0 if writing a level failed, errno is set
+ */
+int pyramid_rows(pyramid *p, U8 *pixels, U64 stride, unsigned int rows)
+{
+    for (unsigned int r = 0; r < rows && p->rows_in < p->height; r++) {
+        p->rows_in++;
+        if (feed(p, 0, pixels + r * stride) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: finish every level's PNG and close the files. Rows never fed
+ *         are taken as transparent black, so each file is complete.
+ *
+ * @return =0  on success
+ *         <>0 if a level could not be written, errno is set
+ */
+int pyramid_close(pyramid *p)
+{
+    int status = 0;
+
+    if (p->rows_in < p->height) {
+        U8 *zero = calloc(p->width, 4);
+
+        while (zero != NULL && status == 0 && p->rows_in < p->height)
+            status = pyramid_rows(p, zero, 0, 1);
+        status = zero == NULL ? -1 : status;
+        free(zero);
+    }
+    /* an odd last row pairs with itself, which may complete the next level */
+    for (int i = 0; i < p->levels && status == 0; i++) {
+        pyr_level *l = &p->level[i];
+
+        if (l->rows_in % 2)
+            status = make_row(p, i, l->pending, l->pending);
+    }
+    if (release(p, p->levels) != 0)
+        status = -1;
+    return status;
+}
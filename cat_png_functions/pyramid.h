@@ -0,0 +1,43 @@
+/**
+ * @file: pyramid.h
+ * @brief: 2x, 4x, 8x ... box filtered copies of an 8-bit RGBA image,
+ *         built and written as PNGs while its rows arrive top to bottom
+ */
+
+#pragma once
+
+#include "pngwrite.h"
+
+/* DEFINES */
+#define PYR_MAX_LEVELS 6 /* down to 1/64 of the size */
+
+/* TYPEDEFS */
+
+/* one downscaled copy, fed by the level above it */
+typedef struct pyr_level {
+    unsigned int width;    /* pixels per row of this level */
+    unsigned int height;
+    unsigned int rows_in;  /* rows the level above has passed down */
+    unsigned int rows_out; /* rows made and written */
+    U8 *pending;           /* even row from above, waiting for its pair */
+    U8 *row;               /* filter byte slot + the row just made */
+    U8 *prev;              /* pixels of the row before it */
+    U8 *filtered;          /* row, filtered for the stream */
+    int fd;
+    png_stream ps;
+} pyr_level;
+
+typedef struct pyramid {
+    unsigned int width;   /* full size image */
+    unsigned int height;
+    unsigned int rows_in; /* full size rows fed so far */
+    int levels;
+    pyr_level level[PYR_MAX_LEVELS]; /* [0] is half size */
+} pyramid;
+
+/* FUNCTION PROTOTYPES */
+int pyramid_open(pyramid *p, unsigned int width, unsigned int height,
+                 int levels, char **paths, U64 chunk_size);
+int pyramid_rows(pyramid *p, U8 *pixels, U64 stride, unsigned int rows);
+int pyramid_close(pyramid *p);
+void pyramid_downscale_row(U8 *dest, U8 *a, U8 *b, unsigned int width);
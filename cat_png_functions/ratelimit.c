@@ -0,0 +1,74 @@
+/**
+ * @file: ratelimit.c
+ * @brief: token bucket rate limiter, lock free in shared memory
+ *
+ * The bucket is a single timestamp, the theoretical arrival time: the
+ * moment the bucket would be full again if nothing more were taken. Taking
+ * n units moves it n intervals on, and whoever takes them must wait until
+ * it is no more than burst ahead of now. One compare and swap per take, so
+ * processes sharing the bucket never block each other, and units are
+ * reserved in the order they were asked for, so the rate is held exactly
+ * over any stretch of time longer than the burst.
+ */
+
+#include <time.h>
+#include "ratelimit.h"
+
+/**
+ * @brief: CLOCK_MONOTONIC in nanoseconds, the time base of the buckets
+ */
+uint64_t tbucket_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief: set up a full bucket, before anyone uses it
+ * @param: rate double units per second, <= 0 for no limit
+ * @param: burst double units that may go at once, at least 1
+ */
+void tbucket_init(tbucket *b, double rate, double burst)
+{
+    b->ns_per_unit = rate > 0 ? 1e9 / rate : 0;
+    b->burst_ns = (uint64_t) ((burst > 1 ? burst : 1) * b->ns_per_unit);
+    b->tat = 0;
+}
+
+/**
+ * @brief: take n units, going into debt if there aren't enough. Units that
+ *         are only known afterwards, like bytes received, are taken the
+ *         same way and make the next taker wait.
+ * @return ns the caller must wait before using them, <= 0 for right away
+ */
+int64_t tbucket_reserve(tbucket *b, uint64_t n, uint64_t now_ns)
+{
+    if (b->ns_per_unit == 0)
+        return 0;
+
+    uint64_t cost = (uint64_t) (n * b->ns_per_unit + 0.5);
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = (tat > now_ns ? tat : now_ns) + cost;
+    } while (!__atomic_compare_exchange_n(&b->tat, &tat, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return (int64_t) (next - b->burst_ns - now_ns);
+}
+
+/**
+ * @brief: how long until the bucket is out of debt, without taking anything
+ * @return ns to wait, <= 0 if units may be taken now
+ */
+int64_t tbucket_delay(tbucket *b, uint64_t now_ns)
+{
+    if (b->ns_per_unit == 0)
+        return 0;
+
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+
+    return (int64_t) (tat - b->burst_ns - now_ns + (uint64_t) b->ns_per_unit);
+}
@@ -0,0 +1,24 @@
+/**
+ * @file: ratelimit.h
+ * @brief: token bucket rate limiter, lock free in shared memory
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* TYPEDEFS */
+
+/* rate units per second with room for burst units at once, kept as the
+   time the bucket would be empty again (GCRA) */
+typedef struct tbucket {
+    double ns_per_unit; /* 0 = unlimited */
+    uint64_t burst_ns;  /* burst units worth of time */
+    uint64_t tat;       /* ns, CLOCK_MONOTONIC, theoretical arrival time */
+} tbucket;
+
+/* FUNCTION PROTOTYPES */
+uint64_t tbucket_clock_ns(void);
+void tbucket_init(tbucket *b, double rate, double burst);
+int64_t tbucket_reserve(tbucket *b, uint64_t n, uint64_t now_ns);
+int64_t tbucket_delay(tbucket *b, uint64_t now_ns);
@@ -0,0 +1,214 @@
+/**
+ * @file: resolver.c
+ * @brief: host name cache in shared memory, resolved once up front and
+ *         refreshed by a background thread, read by curl users through
+ *         CURLOPT_RESOLVE so no request waits on DNS
+ *
+ * Each entry is a seqlock: the one writer makes gen odd, rewrites the line
+ * and makes gen even again; readers copy the line and retry if gen moved
+ * underneath them. Readers in any process never block the writer or each
+ * other, and a reader that only wants to know whether the line changed
+ * needs a single load of gen.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "resolver.h"
+
+void resolver_init(resolver *r)
+{
+    memset(r, 0, sizeof(*r));
+}
+
+/**
+ * @brief: add a name to the cache, unresolved
+ * @return index of the name, -1 if the cache is full or the name too long
+ */
+int resolver_add(resolver *r, const char *host, int port)
+{
+    if (r->count == RESOLVER_HOSTS || strlen(host) >= sizeof(r->hosts[0].host))
+        return -1;
+
+    resolver_entry *e = r->hosts + r->count;
+
+    snprintf(e->host, sizeof(e->host), "%s", host);
+    e->port = port;
+    e->gen = 0;
+    e->line[0] = '\0';
+    return r->count++;
+}
+
+/* look the name up and format its addresses for CURLOPT_RESOLVE */
+static int lookup(const resolver_entry *e, char *line, size_t len)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    int n = 0;
+    size_t used;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(e->host, NULL, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", e->host, gai_strerror(err));
+        return -1;
+    }
+    used = snprintf(line, len, "%s:%d:", e->host, e->port);
+    for (struct addrinfo *ai = res; ai != NULL && n < RESOLVER_ADDRS;
+         ai = ai->ai_next) {
+        char addr[INET6_ADDRSTRLEN + 2];
+        char text[INET6_ADDRSTRLEN];
+
+        if (ai->ai_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in *) ai->ai_addr)->sin_addr,
+                      addr, sizeof(addr));
+        else if (ai->ai_family == AF_INET6
+                 && inet_ntop(AF_INET6,
+                              &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr,
+                              text, sizeof(text)) != NULL)
+            snprintf(addr, sizeof(addr), "[%s]", text);
+        else
+            continue;
+        if (used + strlen(addr) + 2 > len)
+            break;
+        used += snprintf(line + used, len - used, "%s%s", n ? "," : "", addr);
+        n++;
+    }
+    freeaddrinfo(res);
+    return n > 0 ? 0 : -1;
+}
+
+/**
+ * @brief: look every name up again and publish the ones whose addresses
+ *         changed. A name that fails keeps its last addresses. Only one
+ *         process may call this at a time.
+ * @return number of names that couldn't be resolved
+ */
+int resolver_refresh(resolver *r)
+{
+    int failed = 0;
+
+    for (int i = 0; i < r->count; i++) {
+        resolver_entry *e = r->hosts + i;
+        char line[RESOLVER_LINE];
+
+        if (lookup(e, line, sizeof(line)) != 0) {
+            failed++;
+            continue;
+        }
+        if (strcmp(line, e->line) == 0)
+            continue;
+        __atomic_store_n(&e->gen, e->gen + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(e->line, line, sizeof(line));
+        __atomic_store_n(&e->gen, e->gen + 1, __ATOMIC_RELEASE);
+    }
+    return failed;
+}
+
+/**
+ * @brief: generation of name i, changes whenever its line does
+ */
+unsigned int resolver_gen(resolver *r, int i)
+{
+    return __atomic_load_n(&r->hosts[i].gen, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief: copy the CURLOPT_RESOLVE line of name i, "" if it was never
+ *         resolved
+ * @return the generation the copy belongs to
+ */
+unsigned int resolver_read(resolver *r, int i, char *line, size_t len)
+{
+    resolver_entry *e = r->hosts + i;
+    unsigned int gen;
+
+    if (len > sizeof(e->line))
+        len = sizeof(e->line);
+    do {
+        while ((gen = __atomic_load_n(&e->gen, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(line, e->line, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&e->gen, __ATOMIC_RELAXED) != gen);
+    line[len - 1] = '\0';
+    return gen;
+}
+
+static void *refresh_loop(void *arg)
+{
+    resolver_refresher *rf = arg;
+    struct timespec at;
+
+    pthread_mutex_lock(&rf->lock);
+    while (!rf->stopping) {
+        clock_gettime(CLOCK_MONOTONIC, &at);
+        at.tv_sec += rf->interval_ms / 1000;
+        at.tv_nsec += rf->interval_ms % 1000 * 1000000;
+        if (at.tv_nsec >= 1000000000) {
+            at.tv_sec++;
+            at.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&rf->cond, &rf->lock, &at) == ETIMEDOUT
+            && !rf->stopping) {
+            pthread_mutex_unlock(&rf->lock);
+            resolver_refresh(rf->r); /* without the lock, stop doesn't wait on DNS */
+            pthread_mutex_lock(&rf->lock);
+        }
+    }
+    pthread_mutex_unlock(&rf->lock);
+    return NULL;
+}
+
+/**
+ * @brief: refresh the cache every interval_ms in a thread of this process.
+ *         The thread blocks every signal, they stay with the caller.
+ * @return 0 on success, an errno value otherwise
+ */
+int resolver_start(resolver_refresher *rf, resolver *r, long interval_ms)
+{
+    pthread_condattr_t cattr;
+    sigset_t all, old;
+
+    rf->r = r;
+    rf->interval_ms = interval_ms;
+    rf->stopping = 0;
+    pthread_mutex_init(&rf->lock, NULL);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rf->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&rf->thread, NULL, refresh_loop, rf);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        pthread_cond_destroy(&rf->cond);
+        pthread_mutex_destroy(&rf->lock);
+    }
+    return err;
+}
+
+/**
+ * @brief: stop the refresh thread, waiting for a lookup in progress
+ */
+void resolver_stop(resolver_refresher *rf)
+{
+    pthread_mutex_lock(&rf->lock);
+    rf->stopping = 1;
+    pthread_cond_signal(&rf->cond);
+    pthread_mutex_unlock(&rf->lock);
+    pthread_join(rf->thread, NULL);
+    pthread_cond_destroy(&rf->cond);
+    pthread_mutex_destroy(&rf->lock);
+}
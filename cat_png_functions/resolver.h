@@ -0,0 +1,48 @@
+/**
+ * @file: resolver.h
+ * @brief: host name cache in shared memory, resolved once up front and
+ *         refreshed by a background thread, read by curl users through
+ *         CURLOPT_RESOLVE so no request waits on DNS
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+/* DEFINES */
+#define RESOLVER_HOSTS 8   /* most names a cache holds */
+#define RESOLVER_ADDRS 4   /* most addresses kept per name */
+#define RESOLVER_LINE  512 /* bytes of a CURLOPT_RESOLVE entry */
+
+/* TYPEDEFS */
+typedef struct resolver_entry {
+    char host[128];
+    int port;
+    unsigned int gen;         /* seqlock: odd while line is rewritten */
+    char line[RESOLVER_LINE]; /* "host:port:addr[,addr]...", "" until resolved */
+} resolver_entry;
+
+/* lives in shared memory, written by one process and read by any */
+typedef struct resolver {
+    int count;
+    resolver_entry hosts[RESOLVER_HOSTS];
+} resolver;
+
+/* the refresh thread, local to the process that started it */
+typedef struct resolver_refresher {
+    resolver *r;
+    long interval_ms;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stopping;
+} resolver_refresher;
+
+/* FUNCTION PROTOTYPES */
+void resolver_init(resolver *r);
+int resolver_add(resolver *r, const char *host, int port);
+int resolver_refresh(resolver *r);
+unsigned int resolver_gen(resolver *r, int i);
+unsigned int resolver_read(resolver *r, int i, char *line, size_t len);
+int resolver_start(resolver_refresher *rf, resolver *r, long interval_ms);
+void resolver_stop(resolver_refresher *rf);
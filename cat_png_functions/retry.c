@@ -0,0 +1,121 @@
+/**
+ * @file: retry.c
+ * @brief: retry policy for requests to a set of backends: jittered
+ *         exponential backoff, a retry budget shared by every process and
+ *         per backend circuit breakers, lock free in shared memory
+ *
+ * The budget and breakers are plain structs meant to live in shared
+ * memory; every field is only touched with atomics, so producers in
+ * different processes share them without a lock.
+ */
+
+#include <stdlib.h>
+#include "retry.h"
+
+/**
+ * @brief: how long to wait before retry number attempt (1 for the first),
+ *         "full jitter": uniform in [0, min(cap, base * 2^(attempt-1))]
+ * @param: seed unsigned int* caller's rand_r() state
+ */
+long retry_backoff_ms(int attempt, unsigned int *seed)
+{
+    long ceil = RETRY_BASE_MS;
+
+    for (int i = 1; i < attempt && ceil < RETRY_CAP_MS; i++)
+        ceil *= 2;
+    if (ceil > RETRY_CAP_MS)
+        ceil = RETRY_CAP_MS;
+    return rand_r(seed) % (ceil + 1);
+}
+
+/**
+ * @brief: count a first attempt of a request towards the budget
+ */
+void retry_budget_request(retry_budget *b)
+{
+    __atomic_add_fetch(&b->requests, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief: take a retry out of the budget
+ * @return 1 if the retry may go ahead, 0 if the budget is spent
+ */
+int retry_budget_take(retry_budget *b)
+{
+    long retries = __atomic_load_n(&b->retries, __ATOMIC_RELAXED);
+
+    do {
+        long allowed = RETRY_BUDGET_FLOOR +
+            __atomic_load_n(&b->requests, __ATOMIC_RELAXED) *
+            RETRY_BUDGET_PCT / 100;
+
+        if (retries >= allowed)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&b->retries, &retries, retries + 1,
+                                          1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return 1;
+}
+
+/**
+ * @brief: may a request go to the backend now. An open breaker lets one
+ *         trial request through once its cooldown is over.
+ * @return 1 if yes, 0 if the backend should be skipped
+ */
+int breaker_allow(breaker *br, uint64_t now_ms)
+{
+    int state = __atomic_load_n(&br->state, __ATOMIC_ACQUIRE);
+
+    if (state == BREAKER_CLOSED)
+        return 1;
+    if (state == BREAKER_OPEN &&
+        now_ms >= __atomic_load_n(&br->open_until, __ATOMIC_RELAXED))
+        /* only the process that moves it to half open sends the trial */
+        return __atomic_compare_exchange_n(&br->state, &state,
+                                           BREAKER_HALF_OPEN, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief: pick the backend for a request, preferred or else the first one
+ *         after it whose breaker lets it through
+ * @param: brs breaker* the n backends' breakers
+ * @param: admitted int backend the request already holds a go ahead for
+ *         (a rate reservation made after its breaker let it through), -1
+ *         for none. It is kept without asking the breaker again: that may
+ *         have been the half open trial, which only this request can send.
+ *
+ * @return backend, or -1 if every breaker is open
+ */
+int breaker_pick(breaker *brs, int n, int preferred, int admitted,
+                 uint64_t now_ms)
+{
+    if (admitted >= 0)
+        return admitted;
+    for (int i = 0; i < n; i++) {
+        if (breaker_allow(brs + (preferred + i) % n, now_ms))
+            return (preferred + i) % n;
+    }
+    return -1;
+}
+
+/**
+ * @brief: record how a request to the backend went
+ * @param: ok int non zero for success
+ */
+void breaker_result(breaker *br, int ok, uint64_t now_ms)
+{
+    if (ok) {
+        __atomic_store_n(&br->failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&br->state, BREAKER_CLOSED, __ATOMIC_RELEASE);
+        return;
+    }
+    int failures = __atomic_add_fetch(&br->failures, 1, __ATOMIC_RELAXED);
+    if (failures >= BREAKER_FAILURES ||
+        __atomic_load_n(&br->state, __ATOMIC_ACQUIRE) == BREAKER_HALF_OPEN) {
+        __atomic_store_n(&br->open_until, now_ms + BREAKER_COOLDOWN,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&br->state, BREAKER_OPEN, __ATOMIC_RELEASE);
+    }
+}
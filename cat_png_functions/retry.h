@@ -0,0 +1,46 @@
+/**
+ * @file: retry.h
+ * @brief: retry policy for requests to a set of backends: jittered
+ *         exponential backoff, a retry budget shared by every process and
+ *         per backend circuit breakers, lock free in shared memory
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* DEFINES */
+#define RETRY_BASE_MS      50   /* first backoff, doubled per attempt */
+#define RETRY_CAP_MS       2000 /* longest backoff */
+#define RETRY_BUDGET_FLOOR 20   /* retries always allowed ... */
+#define RETRY_BUDGET_PCT   20   /* ... plus this percentage of requests */
+#define BREAKER_FAILURES   5    /* failures in a row that open a breaker */
+#define BREAKER_COOLDOWN   1000 /* ms a breaker stays open before a trial */
+
+#define BREAKER_CLOSED    0
+#define BREAKER_OPEN      1
+#define BREAKER_HALF_OPEN 2 /* one trial request is out */
+
+/* TYPEDEFS */
+
+/* retries allowed so far is RETRY_BUDGET_FLOOR + RETRY_BUDGET_PCT% of
+   requests, so retries can't multiply the load when everything fails */
+typedef struct retry_budget {
+    long requests;
+    long retries;
+} retry_budget;
+
+typedef struct breaker {
+    int state;
+    int failures;        /* in a row */
+    uint64_t open_until; /* ms, CLOCK_MONOTONIC */
+} breaker;
+
+/* FUNCTION PROTOTYPES */
+long retry_backoff_ms(int attempt, unsigned int *seed);
+void retry_budget_request(retry_budget *b);
+int retry_budget_take(retry_budget *b);
+int breaker_allow(breaker *br, uint64_t now_ms);
+int breaker_pick(breaker *brs, int n, int preferred, int admitted,
+                 uint64_t now_ms);
+void breaker_result(breaker *br, int ok, uint64_t now_ms);
@@ -0,0 +1,207 @@
+/**
+ * @file: ringq.c
+ * @brief: bounded FIFO of variable size records in process shared memory,
+ *         with batched push and pop
+ *
+ * The queue is laid out in one block of memory: the ringq header, the
+ * entry ring, then the byte ring the records' data is copied into. Bytes
+ * are reserved and released in FIFO order, exactly as many as a record
+ * needs. The block must be shared memory mapped at the same address in
+ * every process using the queue, e.g. attached before fork().
+ *
+ * Both ends move as many records as they can per lock round trip, so the
+ * cost of synchronization is paid once per batch instead of once per
+ * record. Waiting is done on eventcounts outside the lock: a push wakes at
+ * most as many consumers as it queued records and a pop at most as many
+ * producers as it freed slots, after spinning a little before sleeping.
+ */
+
+#include <string.h>
+#include "ringq.h"
+
+/**
+ * @brief: bytes of memory a queue of the given capacity needs
+ */
+size_t ringq_size(int slots, size_t byte_budget)
+{
+    return sizeof(ringq) + slots * sizeof(ringq_ent) + byte_budget;
+}
+
+/**
+ * @brief: set up a queue at the start of mem
+ * @param: mem void* ringq_size() bytes of shared memory
+ * @param: slots int most records queued at once
+ * @param: byte_budget size_t most record bytes queued at once, also the
+ *         largest record that can be pushed
+ * @param: spin int times a waiter polls before sleeping in the kernel
+ *
+ * @return the queue, which starts at mem
+ */
+ringq *ringq_init(void *mem, int slots, size_t byte_budget, int spin)
+{
+    ringq *q = mem;
+    pthread_mutexattr_t attr;
+
+    memset(q, 0, sizeof(*q));
+    q->slots = slots;
+    q->spin = spin;
+    q->byte_budget = byte_budget;
+    q->ents = (ringq_ent *) ((char *) mem + sizeof(ringq));
+    q->bytes = (unsigned char *) (q->ents + slots);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&q->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    evcount_init(&q->not_empty);
+    evcount_init(&q->not_full);
+    return q;
+}
+
+/**
+ * @brief: release the queue's lock, the memory is the caller's
+ */
+void ringq_destroy(ringq *q)
+{
+    pthread_mutex_destroy(&q->lock);
+}
+
+/* reserve n contiguous bytes, lock held. Returns the offset or -1 if they
+   aren't free right now, *span is set to the bytes to give back later */
+static long reserve_bytes(ringq *q, size_t n, size_t *span)
+{
+    size_t off;
+
+    if (q->bytes_used == 0)
+        q->byte_head = q->byte_tail = 0; /* empty, start over so there's no wrap */
+    else if (q->bytes_used == q->byte_budget)
+        return -1;
+    if (q->byte_head >= q->byte_tail) {
+        /* free space is [head, end) and [0, tail) */
+        if (q->byte_budget - q->byte_head >= n) {
+            off = q->byte_head;
+            *span = n;
+        } else if (q->byte_tail >= n) {
+            off = 0;
+            *span = q->byte_budget - q->byte_head + n; /* skip the end */
+        } else {
+            return -1;
+        }
+    } else {
+        /* free space is [head, tail) */
+        if (q->byte_tail - q->byte_head < n)
+            return -1;
+        off = q->byte_head;
+        *span = n;
+    }
+    q->byte_head = off + n;
+    q->bytes_used += *span;
+    return off;
+}
+
+/**
+ * @brief: append records to the queue, waiting for room as needed. All that
+ *         fit are copied in under one lock round trip, then one consumer
+ *         is woken per record.
+ * @param: recs ringq_rec* records to push, in order
+ * @param: n int number of records
+ *
+ * @return number of records pushed, less than n only if a record is larger
+ *         than the byte budget; the records from there on are not pushed
+ */
+int ringq_push(ringq *q, ringq_rec *recs, int n)
+{
+    int done = 0;
+    int notified = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (done < n) {
+        ringq_rec *r = recs + done;
+        size_t span;
+        long off;
+
+        if (r->size > q->byte_budget)
+            break;
+        if (q->count == q->slots ||
+            (off = reserve_bytes(q, r->size, &span)) < 0) {
+            unsigned int key = evcount_prepare(&q->not_full);
+
+            pthread_mutex_unlock(&q->lock);
+            /* full, let consumers at what went in so far before sleeping */
+            evcount_notify(&q->not_empty, done - notified);
+            notified = done;
+            evcount_wait(&q->not_full, key, q->spin, -1);
+            pthread_mutex_lock(&q->lock);
+            continue;
+        }
+        ringq_ent *e = q->ents + q->tail;
+        e->offset = off;
+        e->size = r->size;
+        e->span = span;
+        e->seq = r->seq;
+        e->slot = r->slot;
+        memcpy(q->bytes + off, r->data, r->size);
+        q->tail = (q->tail + 1) % q->slots;
+        q->count++;
+        done++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    evcount_notify(&q->not_empty, done - notified);
+    return done;
+}
+
+/**
+ * @brief: take up to max records off the queue in one lock round trip,
+ *         waiting until there is at least one or the timeout passes
+ * @param: recs ringq_rec* output, caller supplies max entries
+ * @param: buf unsigned char* the records' data is copied here back to back
+ * @param: buf_len size_t length of buf, at least the byte budget so any
+ *         record fits
+ * @param: timeout_ms long longest wait for a record, < 0 for no limit,
+ *         0 to return right away when the queue is empty
+ *
+ * @return number of records taken, 0 only on timeout
+ */
+int ringq_pop(ringq *q, ringq_rec *recs, int max, unsigned char *buf,
+              size_t buf_len, long timeout_ms)
+{
+    size_t used = 0;
+    int n = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        unsigned int key = evcount_prepare(&q->not_empty);
+        int timed_out;
+
+        pthread_mutex_unlock(&q->lock);
+        if (timeout_ms == 0)
+            return 0;
+        timed_out = evcount_wait(&q->not_empty, key, q->spin, timeout_ms);
+        pthread_mutex_lock(&q->lock);
+        if (timed_out && q->count == 0) {
+            pthread_mutex_unlock(&q->lock);
+            return 0;
+        }
+    }
+    while (n < max && q->count > 0) {
+        ringq_ent *e = q->ents + q->head;
+
+        if (e->size > buf_len - used)
+            break;
+        memcpy(buf + used, q->bytes + e->offset, e->size);
+        recs[n].data = buf + used;
+        recs[n].size = e->size;
+        recs[n].seq = e->seq;
+        recs[n].slot = e->slot;
+        used += e->size;
+        n++;
+
+        q->byte_tail = (q->byte_tail + e->span) % q->byte_budget;
+        q->bytes_used -= e->span;
+        q->head = (q->head + 1) % q->slots;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    evcount_notify(&q->not_full, n);
+    return n;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file: ringq.h
+ * @brief: bounded FIFO of variable size records in process shared memory,
+ *         with batched push and pop
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+#include "evcount.h"
+
+/* TYPEDEFS */
+
+/* a record as handed to ringq_push() or returned by ringq_pop() */
+typedef struct ringq_rec {
+    unsigned char *data; /* push: bytes to copy in, pop: where they were copied */
+    size_t size;
+    int seq;             /* caller's tags, carried along untouched */
+    int slot;
+} ringq_rec;
+
+/* a queued record, its bytes live in the queue's byte ring */
+typedef struct ringq_ent {
+    size_t offset;
+    size_t size;
+    size_t span; /* bytes released with it, size plus any skipped at the end */
+    int seq;
+    int slot;
+} ringq_ent;
+
+typedef struct ringq {
+    pthread_mutex_t lock;
+    evcount not_empty;        /* notified once per record pushed */
+    evcount not_full;         /* notified once per record popped */
+    int spin;                 /* polls of an eventcount before sleeping */
+    int slots;                /* capacity in records */
+    int head;                 /* next entry to pop */
+    int tail;                 /* next entry to push */
+    int count;                /* records queued */
+    size_t byte_budget;       /* capacity in bytes */
+    size_t byte_head;         /* next byte to hand out */
+    size_t byte_tail;         /* oldest byte still in use */
+    size_t bytes_used;        /* in use, including bytes skipped when wrapping */
+    ringq_ent *ents;
+    unsigned char *bytes;
+} ringq;
+
+/* FUNCTION PROTOTYPES */
+size_t ringq_size(int slots, size_t byte_budget);
+ringq *ringq_init(void *mem, int slots, size_t byte_budget, int spin);
+void ringq_destroy(ringq *q);
+int ringq_push(ringq *q, ringq_rec *recs, int n);
+int ringq_pop(ringq *q, ringq_rec *recs, int max, unsigned char *buf,
+              size_t buf_len, long timeout_ms);
@@ -0,0 +1,697 @@
+/**
+ * @file: scanline.c
+ * @brief: PNG scanline filter/unfilter routines (Sub, Up, Average, Paeth)
+ * Reference: https://www.w3.org/TR/PNG-Filters.html
+ *
+ * Every filter has a portable C version that works for any bytes per pixel,
+ * also stamped out with bpp a constant for the other formats fragments come
+ * in (1 for GRAY8, 3 for RGB8, 8 for RGBA16) so their per pixel loops are
+ * unrolled. For 4 bytes per pixel (8-bit RGBA) there are SSE4.1 and AVX2
+ * versions, picked once at run time from what the CPU supports. The environment
+ * variable PNG_SCANLINE_ISA=scalar|sse4.1|avx2 overrides the choice.
+ *
+ * Unfiltering is serial from pixel to pixel for Sub, Average and Paeth, so
+ * the SIMD versions work one pixel (4 lanes) at a time, except Sub which
+ * uses a prefix sum over 4 pixels. Filtering only reads unfiltered data, so
+ * those run 16 (SSE4.1) or 32 (AVX2) bytes at a time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "scanline.h"
+
+typedef void (*unfilter_fn)(U8 *row, U8 *prev, U64 n, int bpp);
+typedef void (*filter_fn)(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp);
+typedef U64 (*cost_fn)(U8 *row, U64 n);
+
+struct scanline_kernels {
+    const char *isa;
+    unfilter_fn unfilter[5]; /* indexed by filter type, [0] unused */
+    filter_fn filter[5];
+    cost_fn cost;
+};
+
+/******************************************************************************
+ * portable C kernels
+ *****************************************************************************/
+
+static inline int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+static inline void unfilter_sub_c(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    for (U64 i = bpp; i < n; i++)
+        row[i] += row[i - bpp];
+}
+
+static void unfilter_up_c(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    for (U64 i = 0; i < n; i++)
+        row[i] += prev[i];
+}
+
+static inline void unfilter_avg_c(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < (U64) bpp && i < n; i++)
+        row[i] += prev[i] >> 1;
+    for (; i < n; i++)
+        row[i] += (row[i - bpp] + prev[i]) >> 1;
+}
+
+static inline void unfilter_paeth_c(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < (U64) bpp && i < n; i++)
+        row[i] += prev[i]; /* paeth(0, b, 0) == b */
+    for (; i < n; i++)
+        row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+static inline void filter_sub_c(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < (U64) bpp && i < n; i++)
+        dest[i] = row[i];
+    for (; i < n; i++)
+        dest[i] = row[i] - row[i - bpp];
+}
+
+static void filter_up_c(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    for (U64 i = 0; i < n; i++)
+        dest[i] = row[i] - prev[i];
+}
+
+static inline void filter_avg_c(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < (U64) bpp && i < n; i++)
+        dest[i] = row[i] - (prev[i] >> 1);
+    for (; i < n; i++)
+        dest[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+}
+
+static inline void filter_paeth_c(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < (U64) bpp && i < n; i++)
+        dest[i] = row[i] - prev[i];
+    for (; i < n; i++)
+        dest[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+/* sum of absolute values of the filtered bytes taken as signed,
+   the usual heuristic for picking a filter per row */
+static U64 cost_c(U8 *row, U64 n)
+{
+    U64 sum = 0;
+
+    for (U64 i = 0; i < n; i++)
+        sum += row[i] < 128 ? row[i] : 256 - row[i];
+    return sum;
+}
+
+#define SCALAR_BPP(n)                                                      \
+    static void unfilter_sub_c##n(U8 *row, U8 *prev, U64 len, int bpp)     \
+    {                                                                      \
+        unfilter_sub_c(row, prev, len, n);                                 \
+    }                                                                      \
+    static void unfilter_avg_c##n(U8 *row, U8 *prev, U64 len, int bpp)     \
+    {                                                                      \
+        unfilter_avg_c(row, prev, len, n);                                 \
+    }                                                                      \
+    static void unfilter_paeth_c##n(U8 *row, U8 *prev, U64 len, int bpp)   \
+    {                                                                      \
+        unfilter_paeth_c(row, prev, len, n);                               \
+    }                                                                      \
+    static void filter_sub_c##n(U8 *dest, U8 *row, U8 *prev, U64 len,     \
+                                int bpp)                                   \
+    {                                                                      \
+        filter_sub_c(dest, row, prev, len, n);                             \
+    }                                                                      \
+    static void filter_avg_c##n(U8 *dest, U8 *row, U8 *prev, U64 len,     \
+                                int bpp)                                   \
+    {                                                                      \
+        filter_avg_c(dest, row, prev, len, n);                             \
+    }                                                                      \
+    static void filter_paeth_c##n(U8 *dest, U8 *row, U8 *prev, U64 len,   \
+                                  int bpp)                                 \
+    {                                                                      \
+        filter_paeth_c(dest, row, prev, len, n);                           \
+    }                                                                      \
+    static const struct scanline_kernels scalar##n##_kernels = {           \
+        "scalar",                                                          \
+        { NULL, unfilter_sub_c##n, unfilter_up_c, unfilter_avg_c##n,       \
+          unfilter_paeth_c##n },                                           \
+        { NULL, filter_sub_c##n, filter_up_c, filter_avg_c##n,             \
+          filter_paeth_c##n },                                             \
+        cost_c                                                             \
+    };
+
+/* Up and the cost don't look at neighbouring pixels, they are shared */
+SCALAR_BPP(1)
+SCALAR_BPP(3)
+SCALAR_BPP(8)
+
+/******************************************************************************
+ * SSE4.1 kernels, 4 bytes per pixel only
+ *****************************************************************************/
+
+static inline __m128i load4(U8 *p)
+{
+    int v;
+    memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void store4(U8 *p, __m128i x)
+{
+    int v = _mm_cvtsi128_si32(x);
+    memcpy(p, &v, 4);
+}
+
+/* Paeth predictor on 16-bit lanes, ties favour a over b over c */
+__attribute__((target("sse4.1")))
+static inline __m128i paeth_sse4(__m128i a, __m128i b, __m128i c)
+{
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    __m128i smallest;
+    __m128i nearest;
+
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    nearest = _mm_blendv_epi8(c, b, _mm_cmpeq_epi16(smallest, pb));
+    return _mm_blendv_epi8(nearest, a, _mm_cmpeq_epi16(smallest, pa));
+}
+
+/* floor((a + b) / 2) per byte, pavgb rounds up */
+__attribute__((target("sse4.1")))
+static inline __m128i avg_floor_sse4(__m128i a, __m128i b)
+{
+    __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+__attribute__((target("sse4.1")))
+static void unfilter_sub_sse4(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    __m128i carry = _mm_setzero_si128(); /* last pixel, broadcast */
+    U64 i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, carry);
+        _mm_storeu_si128((__m128i *) (row + i), x);
+        carry = _mm_shuffle_epi32(x, 0xff);
+    }
+    for (; i < n; i++)
+        row[i] += i >= 4 ? row[i - 4] : 0;
+}
+
+__attribute__((target("sse4.1")))
+static void unfilter_up_sse4(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        __m128i b = _mm_loadu_si128((__m128i *) (prev + i));
+        _mm_storeu_si128((__m128i *) (row + i), _mm_add_epi8(x, b));
+    }
+    for (; i < n; i++)
+        row[i] += prev[i];
+}
+
+__attribute__((target("sse4.1")))
+static void unfilter_avg_sse4(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    __m128i a = _mm_setzero_si128();
+    U64 i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i b = load4(prev + i);
+        a = _mm_add_epi8(load4(row + i), avg_floor_sse4(a, b));
+        store4(row + i, a);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void unfilter_paeth_sse4(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    U64 i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i b = _mm_unpacklo_epi8(load4(prev + i), zero);
+        __m128i x = _mm_unpacklo_epi8(load4(row + i), zero);
+        x = _mm_add_epi8(x, paeth_sse4(a, b, c));
+        a = _mm_and_si128(x, _mm_set1_epi16(0xff));
+        store4(row + i, _mm_packus_epi16(a, a));
+        c = b;
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void filter_sub_sse4(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i = 4;
+
+    memcpy(dest, row, 4);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        __m128i a = _mm_loadu_si128((__m128i *) (row + i - 4));
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_sub_epi8(x, a));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - row[i - 4];
+}
+
+__attribute__((target("sse4.1")))
+static void filter_up_sse4(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        __m128i b = _mm_loadu_si128((__m128i *) (prev + i));
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_sub_epi8(x, b));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - prev[i];
+}
+
+__attribute__((target("sse4.1")))
+static void filter_avg_sse4(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < 4; i++)
+        dest[i] = row[i] - (prev[i] >> 1);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        __m128i a = _mm_loadu_si128((__m128i *) (row + i - 4));
+        __m128i b = _mm_loadu_si128((__m128i *) (prev + i));
+        _mm_storeu_si128((__m128i *) (dest + i),
+                         _mm_sub_epi8(x, avg_floor_sse4(a, b)));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - ((row[i - 4] + prev[i]) >> 1);
+}
+
+__attribute__((target("sse4.1")))
+static void filter_paeth_sse4(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    __m128i zero = _mm_setzero_si128();
+    U64 i;
+
+    for (i = 0; i < 4; i++)
+        dest[i] = row[i] - prev[i];
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        __m128i a = _mm_loadu_si128((__m128i *) (row + i - 4));
+        __m128i b = _mm_loadu_si128((__m128i *) (prev + i));
+        __m128i c = _mm_loadu_si128((__m128i *) (prev + i - 4));
+        __m128i lo = paeth_sse4(_mm_unpacklo_epi8(a, zero),
+                                _mm_unpacklo_epi8(b, zero),
+                                _mm_unpacklo_epi8(c, zero));
+        __m128i hi = paeth_sse4(_mm_unpackhi_epi8(a, zero),
+                                _mm_unpackhi_epi8(b, zero),
+                                _mm_unpackhi_epi8(c, zero));
+        _mm_storeu_si128((__m128i *) (dest + i),
+                         _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - paeth(row[i - 4], prev[i], prev[i - 4]);
+}
+
+__attribute__((target("sse4.1")))
+static U64 cost_sse4(U8 *row, U64 n)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    U64 sum;
+    U64 i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *) (row + i));
+        x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
+    }
+    sum = _mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1);
+    return sum + cost_c(row + i, n - i);
+}
+
+/******************************************************************************
+ * AVX2 kernels, 4 bytes per pixel only
+ *****************************************************************************/
+
+__attribute__((target("avx2")))
+static inline __m256i paeth_avx2(__m256i a, __m256i b, __m256i c)
+{
+    __m256i pa = _mm256_sub_epi16(b, c);
+    __m256i pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    __m256i smallest;
+    __m256i nearest;
+
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+    smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    nearest = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+    return _mm256_blendv_epi8(nearest, a, _mm256_cmpeq_epi16(smallest, pa));
+}
+
+__attribute__((target("avx2")))
+static void unfilter_up_avx2(U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *) (row + i));
+        __m256i b = _mm256_loadu_si256((__m256i *) (prev + i));
+        _mm256_storeu_si256((__m256i *) (row + i), _mm256_add_epi8(x, b));
+    }
+    for (; i < n; i++)
+        row[i] += prev[i];
+}
+
+__attribute__((target("avx2")))
+static void filter_sub_avx2(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i = 4;
+
+    memcpy(dest, row, 4);
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *) (row + i));
+        __m256i a = _mm256_loadu_si256((__m256i *) (row + i - 4));
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_sub_epi8(x, a));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - row[i - 4];
+}
+
+__attribute__((target("avx2")))
+static void filter_up_avx2(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *) (row + i));
+        __m256i b = _mm256_loadu_si256((__m256i *) (prev + i));
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_sub_epi8(x, b));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - prev[i];
+}
+
+__attribute__((target("avx2")))
+static void filter_avg_avx2(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    __m256i one = _mm256_set1_epi8(1);
+    U64 i;
+
+    for (i = 0; i < 4; i++)
+        dest[i] = row[i] - (prev[i] >> 1);
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *) (row + i));
+        __m256i a = _mm256_loadu_si256((__m256i *) (row + i - 4));
+        __m256i b = _mm256_loadu_si256((__m256i *) (prev + i));
+        __m256i odd = _mm256_and_si256(_mm256_xor_si256(a, b), one);
+        __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), odd);
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_sub_epi8(x, avg));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - ((row[i - 4] + prev[i]) >> 1);
+}
+
+__attribute__((target("avx2")))
+static void filter_paeth_avx2(U8 *dest, U8 *row, U8 *prev, U64 n, int bpp)
+{
+    U64 i;
+
+    for (i = 0; i < 4; i++)
+        dest[i] = row[i] - prev[i];
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *) (row + i));
+        __m128i a0 = _mm_loadu_si128((__m128i *) (row + i - 4));
+        __m128i a1 = _mm_loadu_si128((__m128i *) (row + i + 12));
+        __m128i b0 = _mm_loadu_si128((__m128i *) (prev + i));
+        __m128i b1 = _mm_loadu_si128((__m128i *) (prev + i + 16));
+        __m128i c0 = _mm_loadu_si128((__m128i *) (prev + i - 4));
+        __m128i c1 = _mm_loadu_si128((__m128i *) (prev + i + 12));
+        __m256i lo = paeth_avx2(_mm256_cvtepu8_epi16(a0),
+                                _mm256_cvtepu8_epi16(b0),
+                                _mm256_cvtepu8_epi16(c0));
+        __m256i hi = paeth_avx2(_mm256_cvtepu8_epi16(a1),
+                                _mm256_cvtepu8_epi16(b1),
+                                _mm256_cvtepu8_epi16(c1));
+        /* packus works inside 128-bit lanes, put the quadwords back */
+        __m256i pred = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi),
+                                                0xd8);
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_sub_epi8(x, pred));
+    }
+    for (; i < n; i++)
+        dest[i] = row[i] - paeth(row[i - 4], prev[i], prev[i - 4]);
+}
+
+__attribute__((target("avx2")))
+static U64 cost_avx2(U8 *row, U64 n)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    __m128i sum;
+    U64 i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *) (row + i));
+        x = _mm256_min_epu8(x, _mm256_sub_epi8(zero, x));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, zero));
+    }
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                        _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1)
+           + cost_c(row + i, n - i);
+}
+
+/******************************************************************************
+ * dispatch
+ *****************************************************************************/
+
+static const struct scanline_kernels scalar_kernels = {
+    "scalar",
+    { NULL, unfilter_sub_c, unfilter_up_c, unfilter_avg_c, unfilter_paeth_c },
+    { NULL, filter_sub_c, filter_up_c, filter_avg_c, filter_paeth_c },
+    cost_c
+};
+
+static const struct scanline_kernels sse4_kernels = {
+    "sse4.1",
+    { NULL, unfilter_sub_sse4, unfilter_up_sse4, unfilter_avg_sse4,
+      unfilter_paeth_sse4 },
+    { NULL, filter_sub_sse4, filter_up_sse4, filter_avg_sse4,
+      filter_paeth_sse4 },
+    cost_sse4
+};
+
+static const struct scanline_kernels avx2_kernels = {
+    "avx2",
+    { NULL, unfilter_sub_sse4, unfilter_up_avx2, unfilter_avg_sse4,
+      unfilter_paeth_sse4 },
+    { NULL, filter_sub_avx2, filter_up_avx2, filter_avg_avx2,
+      filter_paeth_avx2 },
+    cost_avx2
+};
+
+static const struct scanline_kernels *simd_kernels(void)
+{
+    static const struct scanline_kernels *k = NULL;
+    const char *force;
+
+    if (k != NULL)
+        return k;
+
+    __builtin_cpu_init();
+    force = getenv("PNG_SCANLINE_ISA");
+    if (force != NULL && strcmp(force, "scalar") == 0)
+        k = &scalar_kernels;
+    else if (force != NULL && strcmp(force, "sse4.1") == 0 &&
+             __builtin_cpu_supports("sse4.1"))
+        k = &sse4_kernels;
+    else if (__builtin_cpu_supports("avx2"))
+        k = &avx2_kernels;
+    else if (__builtin_cpu_supports("sse4.1"))
+        k = &sse4_kernels;
+    else
+        k = &scalar_kernels;
+    return k;
+}
+
+static const struct scanline_kernels *kernels_for(int bpp)
+{
+    switch (bpp) {
+    case 4:
+        return simd_kernels();
+    case 1:
+        return &scalar1_kernels;
+    case 3:
+        return &scalar3_kernels;
+    case 8:
+        return &scalar8_kernels;
+    default:
+        return &scalar_kernels;
+    }
+}
+
+/**
+ * @brief: name of the instruction set used for 4 bytes per pixel rows
+ */
+const char *png_scanline_isa(void)
+{
+    return simd_kernels()->isa;
+}
+
+/**
+ * @brief: undo the filter of every scanline in place, so the result can be
+ *         copied next to rows from another image without changing meaning.
+ *         The filter type byte of every row is set to PNG_FILTER_NONE.
+ * @param: scan U8* inflated image data, rows * (rowbytes + 1) bytes
+ * @param: rows unsigned int number of scanlines
+ * @param: rowbytes U64 pixel bytes in a scanline, filter byte excluded
+ * @param: bpp int bytes per complete pixel, rounded up to one
+ *
+ * @return =0  on success
+ *         <>0 on an unknown filter type or out of memory
+ */
+int png_unfilter_rows(U8 *scan, unsigned int rows, U64 rowbytes, int bpp)
+{
+    const struct scanline_kernels *k = kernels_for(bpp);
+    U64 stride = rowbytes + 1;
+    U8 *zero = NULL;
+    U8 *prev;
+
+    for (unsigned int r = 0; r < rows; r++) {
+        U8 *row = scan + r * stride;
+        int type = row[0];
+
+        if (type > PNG_FILTER_PAETH) {
+            free(zero);
+            return -1;
+        }
+        if (r > 0) {
+            prev = row - stride + 1;
+        } else {
+            /* first row of the image, the row above is all zero */
+            if (type == PNG_FILTER_UP || type == PNG_FILTER_AVG ||
+                type == PNG_FILTER_PAETH) {
+                zero = calloc(1, rowbytes);
+                if (zero == NULL) {
+                    return -1;
+                }
+            }
+            prev = zero;
+        }
+        if (type != PNG_FILTER_NONE) {
+            k->unfilter[type](row + 1, prev, rowbytes, bpp);
+        }
+        row[0] = PNG_FILTER_NONE;
+    }
+    free(zero);
+    return 0;
+}
+
+/**
+ * @brief: filter unfiltered scanlines from scan into dest
+ * @param: dest U8* output scanlines, rows * (rowbytes + 1) bytes,
+ *         must not overlap scan
+ * @param: scan U8* unfiltered scanlines, filter type bytes are ignored
+ * @param: prev U8* pixel bytes of the row above the first row, NULL when
+ *         the first row is the top of the image
+ * @param: rows unsigned int number of scanlines
+ * @param: rowbytes U64 pixel bytes in a scanline, filter byte excluded
+ * @param: bpp int bytes per complete pixel, rounded up to one
+ * @param: type int PNG_FILTER_NONE ... PNG_FILTER_PAETH for a fixed filter,
+ *         PNG_FILTER_ADAPTIVE to pick the cheapest filter for every row
+ *
+ * @return =0  on success
+ *         <>0 on an unknown filter type or out of memory
+ */
+int png_filter_rows(U8 *dest, U8 *scan, U8 *prev, unsigned int rows,
+                    U64 rowbytes, int bpp, int type)
+{
+    const struct scanline_kernels *k = kernels_for(bpp);
+    U64 stride = rowbytes + 1;
+    U8 *scratch = NULL; /* zero row, then one candidate row per filter */
+
+    if (type < PNG_FILTER_NONE || type > PNG_FILTER_ADAPTIVE) {
+        return -1;
+    }
+    scratch = calloc(type == PNG_FILTER_ADAPTIVE ? 5 : 1, rowbytes);
+    if (scratch == NULL) {
+        return -1;
+    }
+    if (prev == NULL) {
+        prev = scratch;
+    }
+
+    for (unsigned int r = 0; r < rows; r++) {
+        U8 *row = scan + r * stride + 1;
+        U8 *out = dest + r * stride;
+        int t = type;
+
+        if (r > 0) {
+            prev = row - stride;
+        }
+        if (t == PNG_FILTER_ADAPTIVE) {
+            /* candidates go to scratch rows 1..4, None is the row itself */
+            U64 best = k->cost(row, rowbytes);
+            t = PNG_FILTER_NONE;
+            for (int f = PNG_FILTER_SUB; f <= PNG_FILTER_PAETH; f++) {
+                U8 *cand = scratch + f * rowbytes;
+                U64 cost;
+                k->filter[f](cand, row, prev, rowbytes, bpp);
+                cost = k->cost(cand, rowbytes);
+                if (cost < best) {
+                    best = cost;
+                    t = f;
+                }
+            }
+            if (t == PNG_FILTER_NONE) {
+                memcpy(out + 1, row, rowbytes);
+            } else {
+                memcpy(out + 1, scratch + t * rowbytes, rowbytes);
+            }
+        } else if (t == PNG_FILTER_NONE) {
+            memcpy(out + 1, row, rowbytes);
+        } else {
+            k->filter[t](out + 1, row, prev, rowbytes, bpp);
+        }
+        out[0] = t;
+    }
+    free(scratch);
+    return 0;
+}
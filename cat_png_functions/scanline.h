@@ -0,0 +1,25 @@
+/**
+ * @file: scanline.h
+ * @brief: PNG scanline filter/unfilter routines (Sub, Up, Average, Paeth)
+ *
+ * A scanline is one filter type byte followed by rowbytes bytes of pixel
+ * data, which is exactly how inflated IDAT data is laid out.
+ */
+
+#pragma once
+
+#include "zutil.h"
+
+/* DEFINES */
+#define PNG_FILTER_NONE     0
+#define PNG_FILTER_SUB      1
+#define PNG_FILTER_UP       2
+#define PNG_FILTER_AVG      3
+#define PNG_FILTER_PAETH    4
+#define PNG_FILTER_ADAPTIVE 5 /* pick the cheapest filter per row */
+
+/* FUNCTION PROTOTYPES */
+int png_unfilter_rows(U8 *scan, unsigned int rows, U64 rowbytes, int bpp);
+int png_filter_rows(U8 *dest, U8 *scan, U8 *prev, unsigned int rows,
+                    U64 rowbytes, int bpp, int type);
+const char *png_scanline_isa(void);
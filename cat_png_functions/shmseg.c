@@ -0,0 +1,358 @@
+/**
+ * @file: shmseg.c
+ * @brief: SysV shared memory segments with optional huge pages, NUMA
+ *         placement and prefaulting, plus CPU pinning for the workers
+ *
+ * Segments are created before fork() like plain shmget()/shmat() ones, so
+ * every child sees them at the same address. NUMA placement goes through
+ * the mbind() system call directly, a shm segment keeps the policy for all
+ * processes attached to it, so libnuma is not needed. Everything here is
+ * best effort: on a machine without huge pages or with a single node the
+ * segment is simply a normal one.
+ *
+ * A segment can also be a MAP_SHARED mapping of an unlinked file, for data
+ * larger than memory: the pages are shared by every child the same way, but
+ * the kernel can write them back to the file and reclaim them, and
+ * shm_seg_evict() does it on purpose for parts that are done with.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/syscall.h>
+#include "shmseg.h"
+
+#ifndef SHM_HUGETLB
+#define SHM_HUGETLB 04000
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* memory policies of mbind(), from <numaif.h> */
+#define MPOL_PREFERRED  1
+#define MPOL_INTERLEAVE 3
+
+/* default huge page size from /proc/meminfo, 0 if there is none */
+static size_t huge_page_size(void)
+{
+    char line[128];
+    size_t kb = 0;
+    FILE *fp = fopen("/proc/meminfo", "r");
+
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+static size_t round_up(size_t n, size_t page)
+{
+    return (n + page - 1) / page * page;
+}
+
+static int attach(shm_seg *seg, size_t size, int shmflg)
+{
+    seg->id = shmget(IPC_PRIVATE, size, IPC_CREAT | IPC_EXCL | S_IRUSR |
+                     S_IWUSR | shmflg);
+    if (seg->id == -1)
+        return -1;
+    seg->addr = shmat(seg->id, NULL, 0);
+    if (seg->addr == (void *) -1) {
+        shmctl(seg->id, IPC_RMID, NULL);
+        return -1;
+    }
+    seg->size = size;
+    return 0;
+}
+
+/**
+ * @brief: create and attach a private shared memory segment
+ * @param: seg shm_seg* segment, caller supplies
+ * @param: size size_t bytes needed, rounded up to the page size
+ * @param: flags int SHM_SEG_HUGE or 0
+ *
+ * With SHM_SEG_HUGE hugetlbfs pages are tried first. If none are reserved
+ * (vm.nr_hugepages) normal pages are used and transparent huge pages are
+ * asked for instead.
+ *
+ * @return =0  on success
+ *         <>0 on error, errno is set
+ */
+int shm_seg_create(shm_seg *seg, size_t size, int flags)
+{
+    size_t hpage = (flags & SHM_SEG_HUGE) ? huge_page_size() : 0;
+
+    memset(seg, 0, sizeof(*seg));
+    seg->fd = -1;
+    seg->page = sysconf(_SC_PAGESIZE);
+    if (hpage > 0 && attach(seg, round_up(size, hpage), SHM_HUGETLB) == 0) {
+        seg->page = hpage;
+        seg->huge = 1;
+    } else if (attach(seg, round_up(size, seg->page), 0) != 0) {
+        return -1;
+    } else if (hpage > 0) {
+        /* only takes if /sys/kernel/mm/transparent_hugepage/shmem_enabled
+           allows it, harmless otherwise */
+        if (madvise(seg->addr, seg->size, MADV_HUGEPAGE) == 0)
+            seg->huge = 2;
+    }
+    return 0;
+}
+
+/**
+ * @brief: create a segment backed by a file in dir instead of memory. The
+ *         file has no name, it goes away with the last process using it.
+ * @param: seg shm_seg* segment, caller supplies
+ * @param: dir const char* directory on the disk to put it on
+ * @param: size size_t bytes needed, rounded up to the page size
+ *
+ * @return =0  on success
+ *         <>0 on error, errno is set
+ */
+int shm_seg_file(shm_seg *seg, const char *dir, size_t size)
+{
+    int err;
+
+    memset(seg, 0, sizeof(*seg));
+    seg->id = -1;
+    seg->page = sysconf(_SC_PAGESIZE);
+    seg->size = round_up(size, seg->page);
+    seg->fd = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (seg->fd < 0) {
+        /* file systems without O_TMPFILE */
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/paster2-XXXXXX", dir);
+        seg->fd = mkostemp(path, O_CLOEXEC);
+        if (seg->fd < 0)
+            return -1;
+        unlink(path);
+    }
+    /* sparse, blocks are only taken as pages are written back */
+    if (ftruncate(seg->fd, seg->size) != 0)
+        goto fail;
+    seg->addr = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     seg->fd, 0);
+    if (seg->addr == MAP_FAILED)
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    close(seg->fd);
+    seg->fd = -1;
+    errno = err;
+    return -1;
+}
+
+/**
+ * @brief: tell whether a file backed segment's file is on a file system
+ *         that lives in memory (tmpfs, ramfs), where writing pages back
+ *         to it frees nothing
+ * @param: seg shm_seg* segment made by shm_seg_file()
+ *
+ * @return 1 if it is, 0 if it is not or that can't be told
+ */
+int shm_seg_in_memory(shm_seg *seg)
+{
+    struct statfs fs;
+
+    if (seg->fd < 0 || fstatfs(seg->fd, &fs) != 0)
+        return 0;
+    return fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC;
+}
+
+/**
+ * @brief: detach the segment and remove it
+ * @return =0  on success
+ *         <>0 on error
+ */
+int shm_seg_destroy(shm_seg *seg)
+{
+    if (seg->fd >= 0) {
+        if (munmap(seg->addr, seg->size) != 0)
+            return -1;
+        return close(seg->fd);
+    }
+    if (shmdt(seg->addr) != 0)
+        return -1;
+    return shmctl(seg->id, IPC_RMID, NULL);
+}
+
+/**
+ * @brief: take part of a file backed segment out of memory. Its pages are
+ *         unmapped from the calling process and, with SHM_EVICT_WRITE once
+ *         no other process maps them either, dropped from the page cache; a
+ *         later access reads them back from the file. Only whole pages
+ *         inside the range go, the partial ones at its ends stay.
+ * @param: off size_t start in the segment
+ * @param: len size_t bytes
+ * @param: how int SHM_EVICT_UNMAP, SHM_EVICT_WRITE, or SHM_EVICT_DISCARD
+ *         when the data is not needed again
+ *
+ * @return =0  on success, also for SysV segments, which stay as they are
+ *         <>0 on error, errno is set
+ */
+int shm_seg_evict(shm_seg *seg, size_t off, size_t len, int how)
+{
+    size_t first = round_up(off, seg->page);
+    size_t end = off + len > seg->size ? seg->size : off + len;
+    int err;
+
+    if (seg->fd < 0 || end < first + seg->page)
+        return 0;
+    end -= end % seg->page;
+    /* a hole also unmaps the pages from every process */
+    if (how == SHM_EVICT_DISCARD)
+        return fallocate(seg->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         first, end - first);
+    if (madvise((char *) seg->addr + first, end - first, MADV_DONTNEED) != 0)
+        return -1;
+    if (how == SHM_EVICT_UNMAP)
+        return 0;
+    /* written back first, the page cache only drops clean pages */
+    if (sync_file_range(seg->fd, first, end - first,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+        return -1;
+    err = posix_fadvise(seg->fd, first, end - first, POSIX_FADV_DONTNEED);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: the largest page size a segment created with flags may get. Parts
+ *         of a segment placed on different nodes start on a multiple of it.
+ */
+size_t shm_seg_page(int flags)
+{
+    size_t hpage = (flags & SHM_SEG_HUGE) ? huge_page_size() : 0;
+
+    return hpage > 0 ? hpage : (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief: place part of the segment on the given NUMA nodes. Must be done
+ *         before the pages are first touched.
+ * @param: off size_t start in the segment, a multiple of the page size
+ * @param: len size_t bytes, rounded up to the page size
+ * @param: nodes unsigned long bit mask of nodes
+ * @param: interleave int non zero to spread the pages over all of nodes,
+ *         otherwise the lowest node in nodes is preferred
+ *
+ * @return =0  on success
+ *         <>0 on error, e.g. a kernel without NUMA support
+ */
+int shm_seg_bind(shm_seg *seg, size_t off, size_t len, unsigned long nodes,
+                 int interleave)
+{
+    int mode = MPOL_INTERLEAVE;
+
+    if (nodes == 0 || len == 0)
+        return 0;
+    if (!interleave) {
+        mode = MPOL_PREFERRED;
+        nodes &= -nodes;
+    }
+    len = round_up(len, seg->page);
+    if (off + len > seg->size)
+        len = seg->size - off;
+    /* maxnode is one more than the bits in the mask, see mbind(2) */
+    return syscall(SYS_mbind, (char *) seg->addr + off, len, mode, &nodes,
+                   sizeof(nodes) * 8 + 1, 0);
+}
+
+/**
+ * @brief: fault in part of the segment now instead of on first write by
+ *         whichever worker gets there first
+ */
+void shm_seg_prefault(shm_seg *seg, size_t off, size_t len)
+{
+    volatile char *p = (char *) seg->addr + off;
+
+    if (off + len > seg->size)
+        len = seg->size - off;
+    if (madvise((char *) seg->addr + off, len, MADV_POPULATE_WRITE) == 0)
+        return;
+    /* kernels before 5.14, one write per page */
+    for (size_t i = 0; i < len; i += seg->page)
+        p[i] = p[i];
+}
+
+/**
+ * @brief: the CPUs this process may run on, in order
+ * @param: cpus int* output, caller supplies max entries
+ *
+ * @return number of CPUs stored, at least 1
+ */
+int cpu_list(int *cpus, int max)
+{
+    cpu_set_t set;
+    int n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        cpus[0] = 0;
+        return 1;
+    }
+    for (int c = 0; c < CPU_SETSIZE && n < max; c++) {
+        if (CPU_ISSET(c, &set))
+            cpus[n++] = c;
+    }
+    return n > 0 ? n : 1;
+}
+
+/**
+ * @brief: NUMA node of a CPU, from the nodeN link in its sysfs directory
+ * @return node number, 0 when it can't be told
+ */
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *de;
+    int node = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "node%d", &node) == 1)
+            break;
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * @brief: run the calling process only on cpu
+ * @return =0  on success
+ *         <>0 on error
+ */
+int pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
@@ -0,0 +1,43 @@
+/**
+ * @file: shmseg.h
+ * @brief: SysV shared memory segments with optional huge pages, NUMA
+ *         placement and prefaulting, file backed shared mappings that can
+ *         be written back and dropped piece by piece, plus CPU pinning for
+ *         the workers
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* DEFINES */
+#define SHM_SEG_HUGE 0x1 /* back the segment with huge pages */
+
+/* what shm_seg_evict() does with the pages */
+#define SHM_EVICT_UNMAP   0 /* unmap them from this process only */
+#define SHM_EVICT_WRITE   1 /* write them back and drop them from memory */
+#define SHM_EVICT_DISCARD 2 /* throw them away, they read as zeros again */
+
+/* TYPEDEFS */
+typedef struct shm_seg {
+    int id;
+    void *addr;
+    size_t size; /* rounded up to page */
+    size_t page; /* page size the segment is aligned to */
+    int huge;    /* 1 if hugetlbfs pages back it, 2 if transparent ones may */
+    int fd;      /* backing file of shm_seg_file() ones, -1 for SysV ones */
+} shm_seg;
+
+/* FUNCTION PROTOTYPES */
+int shm_seg_create(shm_seg *seg, size_t size, int flags);
+int shm_seg_file(shm_seg *seg, const char *dir, size_t size);
+int shm_seg_in_memory(shm_seg *seg);
+int shm_seg_destroy(shm_seg *seg);
+int shm_seg_evict(shm_seg *seg, size_t off, size_t len, int how);
+int shm_seg_bind(shm_seg *seg, size_t off, size_t len, unsigned long nodes,
+                 int interleave);
+void shm_seg_prefault(shm_seg *seg, size_t off, size_t len);
+size_t shm_seg_page(int flags);
+int cpu_list(int *cpus, int max);
+int cpu_node(int cpu);
+int pin_cpu(int cpu);
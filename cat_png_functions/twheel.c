@@ -0,0 +1,119 @@
+/**
+ * @file: twheel.c
+ * @brief: hashed timing wheel for millisecond timers, single process
+ *
+ * A timer due at tick t sits in bucket t % TWHEEL_SLOTS. Expiring walks
+ * the buckets from the last tick handled up to the current one and takes
+ * out the timers that are due; timers more than a revolution away stay in
+ * their bucket until their turn comes round. Adding and expiring a timer
+ * are O(1) no matter how many are pending.
+ */
+
+#include <stddef.h>
+#include <time.h>
+#include "twheel.h"
+
+/**
+ * @brief: CLOCK_MONOTONIC in milliseconds, the time base of the wheel
+ */
+uint64_t twheel_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief: set up an empty wheel
+ * @param: tick_ms uint64_t resolution of the timers, >= 1
+ * @param: now_ms uint64_t current time from twheel_clock_ms()
+ */
+void twheel_init(twheel *tw, uint64_t tick_ms, uint64_t now_ms)
+{
+    for (int i = 0; i < TWHEEL_SLOTS; i++)
+        tw->slots[i] = NULL;
+    tw->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    tw->now = now_ms / tw->tick_ms;
+    tw->count = 0;
+}
+
+/**
+ * @brief: start a timer
+ * @param: t twheel_timer* caller supplied, arg set by the caller
+ * @param: expires_ms uint64_t when it is due, rounded up to a tick; times
+ *         already past are due on the next twheel_expire()
+ */
+void twheel_add(twheel *tw, twheel_timer *t, uint64_t expires_ms)
+{
+    uint64_t tick = (expires_ms + tw->tick_ms - 1) / tw->tick_ms;
+
+    if (tick < tw->now)
+        tick = tw->now;
+    t->expires = tick;
+    t->next = tw->slots[tick % TWHEEL_SLOTS];
+    tw->slots[tick % TWHEEL_SLOTS] = t;
+    tw->count++;
+}
+
+/**
+ * @brief: take every timer due by now_ms off the wheel
+ * @return list of the due timers linked through next, NULL if none
+ */
+twheel_timer *twheel_expire(twheel *tw, uint64_t now_ms)
+{
+    uint64_t now = now_ms / tw->tick_ms;
+    twheel_timer *due = NULL;
+
+    if (tw->count == 0) {
+        if (now > tw->now)
+            tw->now = now;
+        return NULL;
+    }
+    /* more than a revolution behind, every bucket needs one look only */
+    if (now > tw->now && now - tw->now >= TWHEEL_SLOTS)
+        tw->now = now - TWHEEL_SLOTS + 1;
+    for (; tw->now <= now; tw->now++) {
+        twheel_timer **pp = &tw->slots[tw->now % TWHEEL_SLOTS];
+
+        while (*pp != NULL) {
+            twheel_timer *t = *pp;
+
+            if (t->expires <= now) {
+                *pp = t->next;
+                t->next = due;
+                due = t;
+                tw->count--;
+            } else {
+                pp = &t->next;
+            }
+        }
+    }
+    tw->now = now; /* the current tick can still get timers */
+    return due;
+}
+
+/**
+ * @brief: milliseconds until the next timer is due
+ * @return 0 if one is due already, -1 if the wheel is empty
+ */
+long twheel_next(twheel *tw, uint64_t now_ms)
+{
+    uint64_t first = UINT64_MAX;
+
+    if (tw->count == 0)
+        return -1;
+    /* the next revolution's buckets in order, the first hit is the earliest */
+    for (uint64_t tick = tw->now; tick < tw->now + TWHEEL_SLOTS; tick++) {
+        for (twheel_timer *t = tw->slots[tick % TWHEEL_SLOTS]; t != NULL;
+             t = t->next) {
+            if (t->expires < first)
+                first = t->expires;
+        }
+        if (first <= tick)
+            break;
+    }
+    if (first * tw->tick_ms <= now_ms)
+        return 0;
+    return (long) (first * tw->tick_ms - now_ms);
+}
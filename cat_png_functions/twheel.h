@@ -0,0 +1,34 @@
+/**
+ * @file: twheel.h
+ * @brief: hashed timing wheel for millisecond timers, single process
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* DEFINES */
+#define TWHEEL_SLOTS 512 /* buckets, a power of two */
+
+/* TYPEDEFS */
+
+/* a timer, embedded in or pointing at the caller's data */
+typedef struct twheel_timer {
+    struct twheel_timer *next;
+    uint64_t expires; /* tick it is due, absolute */
+    void *arg;
+} twheel_timer;
+
+typedef struct twheel {
+    twheel_timer *slots[TWHEEL_SLOTS];
+    uint64_t tick_ms; /* milliseconds per tick */
+    uint64_t now;     /* ticks up to here have been expired */
+    int count;        /* timers pending */
+} twheel;
+
+/* FUNCTION PROTOTYPES */
+uint64_t twheel_clock_ms(void);
+void twheel_init(twheel *tw, uint64_t tick_ms, uint64_t now_ms);
+void twheel_add(twheel *tw, twheel_timer *t, uint64_t expires_ms);
+twheel_timer *twheel_expire(twheel *tw, uint64_t now_ms);
+long twheel_next(twheel *tw, uint64_t now_ms);
@@ -137,6 +137,44 @@ int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
     return (ret == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
 }
 
+/**
+ * @brief: inflate in memory data from source to dest with a stream the
+ *         caller keeps across calls, so zlib's state is allocated once
+ * @param: strm z_stream* set up once with inflateInit(), reset here
+ * @param: dest U8* output buffer, the data is inflated straight into it
+ * @param: dest_len U64* in: size of dest, out: length of inflated data
+ * @param: source U8* source buffer, contains zlib data to be inflated
+ * @param: source_len U64 length of source data
+ *
+ * @return =0  on success
+ *         <>0 error, Z_BUF_ERROR when dest is too small
+ */
+int mem_inf_z(z_stream *strm, U8 *dest, U64 *dest_len, U8 *source,
+              U64 source_len)
+{
+    int ret = inflateReset(strm);
+
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm->next_in = source;
+    strm->avail_in = source_len;
+    strm->next_out = dest;
+    strm->avail_out = *dest_len;
+
+    ret = inflate(strm, Z_FINISH); /* dest holds all of it or it's an error */
+    *dest_len = *dest_len - strm->avail_out;
+    switch (ret) {
+    case Z_STREAM_END:
+        return Z_OK;
+    case Z_OK:
+    case Z_NEED_DICT:
+        return Z_DATA_ERROR;
+    default:
+        return ret;
+    }
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
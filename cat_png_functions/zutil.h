@@ -35,4 +35,6 @@ typedef unsigned long int U64;
 /* FUNCTION PROTOTYPES */
 int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level);
 int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
+int mem_inf_z(z_stream *strm, U8 *dest, U64 *dest_len, U8 *source,
+              U64 source_len);
 void zerr(int ret);
@@ -1,4 +1,10 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,8 +13,11 @@
 #include <curl/curl.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <sys/wait.h>
-#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
@@ -16,6 +25,19 @@
 #include "./cat_png_functions/zutil.h"
 #include "./cat_png_functions/crc.h"
 #include "./cat_png_functions/pnginfo.h"
+#include "./cat_png_functions/scanline.h"
+#include "./cat_png_functions/pngwrite.h"
+#include "./cat_png_functions/shmseg.h"
+#include "./cat_png_functions/ringq.h"
+#include "./cat_png_functions/twheel.h"
+#include "./cat_png_functions/retry.h"
+#include "./cat_png_functions/resolver.h"
+#include "./cat_png_functions/ratelimit.h"
+#include "./cat_png_functions/arena.h"
+#include "./cat_png_functions/pyramid.h"
+#include "./cat_png_functions/pixfmt.h"
+#include "./cat_png_functions/perfctr.h"
+#include "./cat_png_functions/metrics.h"
 
 struct thread_arg
 {
@@ -31,6 +53,11 @@ struct thread_arg
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+#define min(a, b) \
+    ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
 typedef struct recv_buf2
 {
     char *buf;       /* memory to hold a copy of received data */
@@ -38,11 +65,12 @@ typedef struct recv_buf2
     size_t max_size; /* max capacity of buf in bytes*/
     int seq;         /* >=0 sequence number extracted from http header */
                      /* <0 indicates an invalid seq number */
+    arena *mem;      /* where buf comes from, NULL for malloc */
 } RECV_BUF;
 
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int recv_buf_init(RECV_BUF *ptr, size_t max_size, arena *mem);
 int recv_buf_cleanup(RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
 
@@ -94,7 +122,7 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     { /* hope this rarely happens */
         /* received data is not 0 terminated, add one byte for terminating 0 */
         size_t new_size = p->max_size + max(BUF_INC, realsize + 1);
-        char *q = realloc(p->buf, new_size);
+        char *q = p->mem != NULL ? arena_realloc(p->mem, p->buf, new_size) : realloc(p->buf, new_size);
         if (q == NULL)
         {
             perror("realloc"); /* out of memory */
@@ -111,7 +139,7 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     return realsize;
 }
 
-int recv_buf_init(RECV_BUF *ptr, size_t max_size)
+int recv_buf_init(RECV_BUF *ptr, size_t max_size, arena *mem)
 {
     void *p = NULL;
 
@@ -120,7 +148,7 @@ int recv_buf_init(RECV_BUF *ptr, size_t max_size)
         return 1;
     }
 
-    p = malloc(max_size);
+    p = mem != NULL ? arena_alloc(mem, max_size) : malloc(max_size);
     if (p == NULL)
     {
         return 2;
@@ -130,6 +158,7 @@ int recv_buf_init(RECV_BUF *ptr, size_t max_size)
     ptr->size = 0;
     ptr->max_size = max_size;
     ptr->seq = -1; /* valid seq should be non-negative */
+    ptr->mem = mem;
     return 0;
 }
 
@@ -140,408 +169,2650 @@ int recv_buf_cleanup(RECV_BUF *ptr)
         return 1;
     }
 
-    free(ptr->buf);
+    if (ptr->mem != NULL)
+    {
+        arena_free(ptr->mem, ptr->buf);
+    }
+    else
+    {
+        free(ptr->buf);
+    }
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
 }
 
-typedef struct img_data
+#define MAX_BANDS 1024 // most fragments an image may be split into
+
+typedef struct geometry
 {
-    unsigned char buf[10000]; // image segment is less than 10000 bytes
-    size_t size;
-    int seq;
-} img_data;
+    unsigned int width;       // pixels per row
+    unsigned int band_height; // rows per fragment
+    unsigned int bands;       // fragments per image
+} geometry;
+
+#define ROW_BYTES(g) ((unsigned long)(g)->width * 4 + 1)      // filter byte + RGBA pixels
+#define BAND_BYTES(g) ((g)->band_height * ROW_BYTES(g))        // inflated size of one fragment
+#define CANVAS_BYTES(g) ((g)->bands * BAND_BYTES(g))           // inflated size of the image
+
+static const geometry default_geometry = {400, 6, 50};
 
-typedef struct ring_buff
+#define MAX_RANGES 8 // row ranges a job may ask for
+
+// rows first to last of the image, both included
+typedef struct row_range
 {
-    int prod_it;
-    int cons_it;
-    img_data *img_data;
-    int new_img_count;
-} ring_buff;
+    unsigned int first;
+    unsigned int last;
+} row_range;
 
-typedef struct shared
+// a canvas's claims word; the post count tells a job from the one before it in the same canvas
+#define CLAIMS(posts, fragments, taken) ((uint64_t)(posts) << 32 | (uint64_t)(fragments) << 16 | (taken))
+#define CLAIMS_FRAGMENTS(c) ((int)((c) >> 16 & 0xffff))
+#define CLAIMS_TAKEN(c) ((int)((c)&0xffff))
+
+// one image being stitched; canvases are allocated once and reused by job after job
+typedef struct canvas
 {
-    sem_t spaces;
-    sem_t items;
-    pthread_mutex_t lock;
-    unsigned char buffer[300 * (400 * 4 + 1)];
+    int active;         // 1 while a job owns the canvas
+    int image;          // image number N on the servers
+    geometry geo;       // shape of the image and its fragments
+    uint64_t claims;    // CLAIMS() of the job: posts so far, its fragments and those producers took
+    int fragments;      // bands the job needs, fragment i being band band_of[i]
+    unsigned short band_of[MAX_BANDS]; // band each of the job's fragments is
     unsigned long total_IDAT_compress_length;
-    int images_downloaded;
-    int images_processed;
-} shared;
+    unsigned char band_done[MAX_BANDS]; // 1 once band i is in buffer
+    int bands_settled;                  // fragments stitched or given up, the job is over at fragments
+    unsigned char *buffer;              // canvas_bytes bytes
+} canvas;
+
+#define NUM_HOSTS 3 // ece252-1 to ece252-3
+#define HOST_NAME "ece252-%d.uwaterloo.ca"
+#define HOST_PORT 2530
+#define LIMIT_BURST 0.1 // seconds of a rate limit that may go at once
 
-void producer(shared *shared_mem, ring_buff *placeholder, int N, int B)
+// how a producer talks to one backend
+enum host_proto
 {
-    while (1)
-    {
-        pthread_mutex_lock(&shared_mem->lock);
-        int img_sec = shared_mem->images_downloaded; // check how many images have been downloaded
-        shared_mem->images_downloaded += 1;
-        pthread_mutex_unlock(&shared_mem->lock);
-        if (img_sec >= 50) // break out of loop if 50+ have been downloaded
-        {
-            break;
-        }
-        else // wait for space to show up in buffer to download
-        {
-            sem_wait(&shared_mem->spaces);
-        }
-        CURL *curl_handle;
-        CURLcode res;
-        RECV_BUF recv_buf;
-        char url[256];
+    PROTO_H1,         // HTTP/1.1, a connection per transfer in flight
+    PROTO_H2C,        // cleartext HTTP/2 with prior knowledge, transfers multiplexed on one connection
+    PROTO_H2_UPGRADE, // HTTP/1.1 with an Upgrade: h2c offer, for servers that don't take prior knowledge
+    PROTO_H2C_SEEN,   // PROTO_H2C once the backend has answered over it
+};
 
-        recv_buf_init(&recv_buf, BUF_SIZE);
+// stretches of the pipeline counted with -e
+enum stage
+{
+    STAGE_FETCH,    // a producer downloading its claimed batch, retries included
+    STAGE_PUBLISH,  // a producer putting the batch on the ring
+    STAGE_INFLATE,  // a consumer inflating and unfiltering a fragment
+    STAGE_COPY,     // a consumer copying the rows into the canvas
+    STAGE_DEFLATE,  // the parent filtering and compressing output rows
+    STAGE_PRODUCER, // a producer's whole life, waiting included
+    STAGE_CONSUMER, // a consumer's whole life
+    STAGES
+};
 
-        /* init a curl session */
-        curl_handle = curl_easy_init();
+static const char *const stage_names[STAGES] = {"fetch", "publish", "inflate", "copy", "deflate", "producers", "consumers"};
 
-        if (curl_handle == NULL)
-        {
-            fprintf(stderr, "curl_easy_init: returned NULL\n");
-        }
-        else
-        {
-            /* specify URL to get */
-            sprintf(url, "http://ece252-%d.uwaterloo.ca:2530/image?img=%d&part=%d", img_sec % 3 + 1, N, img_sec);
-            curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+#define CACHE_LINE 64
 
-            // set DNS cache
-            curl_easy_setopt(curl_handle, CURLOPT_DNS_CACHE_TIMEOUT, 60L); // Cache DNS for 60 seconds
+#define LATENCY_BUCKETS 11 // request duration histogram, plus one for longer
+static const long latency_bounds_us[LATENCY_BUCKETS] = {5000,   10000,   25000,   50000,   100000, 250000,
+                                                        500000, 1000000, 2500000, 5000000, 10000000};
 
-            /* register write call back function to process received data */
-            curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3);
-            /* user defined data structure passed to the call back function */
-            curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
+// requests to one backend, counted by every producer for the metrics
+typedef struct host_stats
+{
+    long requests;   // transfers finished, failed or not
+    long failures;
+    long inflight;   // transfers running now
+    long latency_us; // summed over the finished ones
+    long latency[LATENCY_BUCKETS + 1]; // finished ones by duration, not cumulative
+} __attribute__((aligned(CACHE_LINE))) host_stats;
 
-            /* register header call back function to process received header data */
-            curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl);
-            /* user defined data structure passed to the call back function */
-            curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
+// The claim counters are bumped with atomics by every worker, each gets a cache line
+// of its own so producers and consumers don't bounce one line between them.
+typedef struct shared
+{
+    pthread_mutex_t lock;
+    pthread_cond_t job_posted;  // broadcast when a job is posted or no more will come
+    int band_efd;               // eventfd, written when a band lands or a consumer exits
+    int slots;                  // number of canvases, jobs in flight at once
+    unsigned long canvas_bytes; // capacity of each canvas
+    shm_seg canvas_seg;         // file the canvases are mapped from with -F or -L, fd -1 otherwise
+    unsigned long mem_ceiling;  // canvas bytes the parent lets stay in memory, 0 for no limit
+    unsigned long resident;     // canvas bytes landed and not yet written back, parent only
+    unsigned long spilled;      // canvas bytes written back early to stay under the ceiling
+    int claim_batch;            // fragments a worker claims at once
+    int inflight;               // fragments a consumer may have in processing at once
+    int host_proto[NUM_HOSTS];  // enum host_proto producers use for each backend
+    breaker breakers[NUM_HOSTS]; // skip a backend that keeps failing
+    resolver dns;               // backend addresses, resolved by the parent only
+    retry_budget budget;        // retries allowed over every producer
+    long request_timeout;       // ms a fragment request may take
+    int max_attempts;           // tries per fragment before its band is given up
+    tbucket req_limit;          // requests/s over every producer
+    tbucket byte_limit;         // bytes/s over every producer
+    tbucket host_req_limit[NUM_HOSTS];
+    tbucket host_byte_limit[NUM_HOSTS];
+    long limit_waits;           // requests the limits held back
+    arena_stats producer_mem;   // every producer's buffer allocations, added up as they exit
+    arena_stats consumer_mem;   // the same for the consumers
+    uint64_t limit_wait_ns;     // time they were held back, in total
+    int perf;                   // 1 to count every stage with perf_event_open
+    host_stats host_stats[NUM_HOSTS];
+    long fragments_stitched;    // in a canvas
+    long fragments_dropped;     // arrived, but bad
+    long fragments_lost;        // given up on by a producer
+    long fragments_delayed;     // taken off the ring, waiting out a consumer's delay
+    long jobs_done;
+    long jobs_failed;
+    perf_total stages[STAGES];  // what each stage cost, over every process
+    canvas *canvases;
+    int images_downloaded __attribute__((aligned(CACHE_LINE))); // fragments claimed by producers, over all jobs
+    unsigned int claim_turn;    // canvas the next producer claim starts at, see pick_fragments
+    int images_processed __attribute__((aligned(CACHE_LINE)));  // fragments claimed by consumers, over all jobs
+    int total_fragments __attribute__((aligned(CACHE_LINE)));   // fragments of every job posted so far
+    int closed;                 // 1 once no more jobs will be posted
+    int consumers_done;         // consumers that have left their loop
+} shared;
 
-            /* some servers requires a user-agent field */
-            curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+// a job as read from a batch file or a daemon request, parent only
+typedef struct job
+{
+    int image;
+    geometry geo;
+    row_range rows[MAX_RANGES]; // sorted and apart, what goes into the output
+    int ranges;                 // 0 for the whole image
+    char output[256]; // path, "-" for stdout or "fd" for a descriptor sent with the request
+    int out_fd;       // descriptor sent with a daemon request, -1 otherwise
+    int reply_fd;     // daemon connection to answer, -1 otherwise
+} job;
 
-            /* get it! */
-            res = curl_easy_perform(curl_handle);
+#define DAEMON_CLIENTS 16   // daemon connections whose request may be coming in at once
+#define DAEMON_READ_MS 5000 // how long a client has to send its whole request
 
-            // get curl again if couldn't rersolve host (common error when running high thread count)
-            while (res == CURLE_COULDNT_RESOLVE_HOST)
-            {
-                res = curl_easy_perform(curl_handle);
-            }
+// a daemon connection whose request line is still coming in, parent only
+typedef struct daemon_client
+{
+    int fd;         // -1 for a free entry
+    int passed_fd;  // descriptor sent along with the request, -1 until one comes
+    size_t len;     // bytes of the line read so far
+    double since;   // when it connected
+    char line[512];
+} daemon_client;
 
-            if (res != CURLE_OK)
-            {
-                fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            }
-            else
-            {
-                pthread_mutex_lock(&shared_mem->lock);
-                if (placeholder->prod_it == B)
-                { // buffer cap reached, reset iterator to 0
-                    placeholder->prod_it = 0;
-                }
-                img_data *temp = placeholder->img_data + placeholder->prod_it; // save data at current iterator of ring buffer
-                placeholder->prod_it += 1;                                     // increase iterator for next
-                temp->seq = recv_buf.seq;                                      // store img sequence number
-                memcpy(temp->buf, recv_buf.buf, recv_buf.size);                // store img data
-                temp->size = recv_buf.size;                                    // store size (for memcpy and stuff)
-                // printf("image %d downloaded\n", temp->seq);
-                placeholder->new_img_count += 1; // increase new_img count for consumers
-                // printf("prod img_count: %d\n", placeholder->new_img_count);
-                pthread_mutex_unlock(&shared_mem->lock);
-                sem_post(&shared_mem->items); // signal there is an image to download
-            }
-        }
-        /* cleaning up */
-        curl_easy_cleanup(curl_handle);
-        recv_buf_cleanup(&recv_buf);
+// parent's bookkeeping for the job in a canvas
+typedef struct slot_state
+{
+    int busy;
+    job jb;
+    int next;                 // fragments, in band order, that are in (and streamed)
+    unsigned int out_rows;    // rows of the output image
+    int last_row;             // canvas row last streamed, -1 before the first
+    int out_fd;               // stream target while streaming, -1 otherwise
+    png_stream ps;            // used while streaming
+    unsigned char *filtered;  // one filtered band, streaming only
+    pyramid *pyr;             // downscaled copies being written, NULL for none
+    double started;           // when the job was posted
+    unsigned char band_mem[MAX_BANDS]; // enum band_mem of each band, file backed canvases only
+    int discarded;            // fragments, in band order, whose bands were thrown away
+} slot_state;
+
+// where a band of a file backed canvas is
+enum band_mem
+{
+    BAND_ABSENT,   // not landed yet, or not counted yet
+    BAND_RESIDENT, // in memory, counts against the ceiling
+    BAND_EVICTED,  // written back to the file or thrown away
+};
+
+// this process's counters, not open without -e
+static perf_counters perf_self = {.leader = -1};
+
+/**
+ * @brief  start counting a stage, a no-op unless this process counts
+ */
+void stage_begin(perf_sample *s)
+{
+    if (perf_self.leader >= 0)
+    {
+        perf_read(&perf_self, s);
+    }
+}
+
+/**
+ * @brief  add what the stage begun at s cost to its totals
+ */
+void stage_end(shared *shared_mem, int stage, perf_sample *s)
+{
+    if (perf_self.leader >= 0)
+    {
+        perf_add(shared_mem->stages + stage, &perf_self, s);
     }
 }
 
-void consumer(shared *shared_mem, ring_buff *placeholder, int x, int B)
+double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec) + tv.tv_usec / 1000000.;
+}
+
+/**
+ * @brief  claim up to claim_batch consecutive fragment numbers from counter.
+ *         The lock is only taken to sleep when every posted fragment has been
+ *         claimed already.
+ * @param  int *count set to the number of fragments claimed
+ * @param  int wait 0 to return -2 instead of sleeping when there is nothing to claim
+ * @return first fragment number, or -1 once the job queue is closed and drained
+ */
+int claim_fragments(shared *shared_mem, int *counter, int *count, int wait)
 {
+    int first = __atomic_load_n(counter, __ATOMIC_RELAXED);
     while (1)
     {
-        pthread_mutex_lock(&shared_mem->lock);
-        int img_sec = shared_mem->images_processed; // how many current images have been processed
-        shared_mem->images_processed += 1;          // increment global counter
-        pthread_mutex_unlock(&shared_mem->lock);
-        if (img_sec >= 50) // break out if 50
+        // acquire pairs with post_job, the canvas of every fragment below total is set up
+        int total = __atomic_load_n(&shared_mem->total_fragments, __ATOMIC_ACQUIRE);
+        if (first < total)
         {
-            break;
+            int last = total - first > shared_mem->claim_batch ? first + shared_mem->claim_batch : total;
+            // a plain fetch-add could run past total, so compare-and-swap; first is reloaded on failure
+            if (__atomic_compare_exchange_n(counter, &first, last, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                *count = last - first;
+                return first;
+            }
+            continue;
         }
-        else // wait for new images to come in
+        if (!wait && !__atomic_load_n(&shared_mem->closed, __ATOMIC_ACQUIRE))
         {
-            sem_wait(&shared_mem->items);
+            return -2;
         }
         pthread_mutex_lock(&shared_mem->lock);
-        if (placeholder->cons_it == B) // check iterator, if it's at 50 (from prev), reset to 0
+        while (__atomic_load_n(counter, __ATOMIC_RELAXED) >= shared_mem->total_fragments && !shared_mem->closed)
         {
-            placeholder->cons_it = 0;
+            pthread_cond_wait(&shared_mem->job_posted, &shared_mem->lock);
         }
-        img_data *temp = placeholder->img_data + placeholder->cons_it; // image data with the current iterator to be read from
-        placeholder->cons_it += 1;                                     // increment iterator
-        char *pic = malloc(temp->size);
-        memcpy(pic, temp->buf, temp->size); // read picture
-        placeholder->new_img_count -= 1;
-        // printf("cons img_count: %d\n", placeholder->new_img_count);
+        int drained = __atomic_load_n(counter, __ATOMIC_RELAXED) >= shared_mem->total_fragments;
         pthread_mutex_unlock(&shared_mem->lock);
-        
-        usleep(x * 1000); // sleep in microseconds, *1000 for milli
-
-        // inflate img data
-        unsigned int curr_height = 6;
-        unsigned int width = 400;
-        unsigned int data_length;
-        memcpy(&data_length, pic + 33, 4); // read compressed data length
-        data_length = htonl(data_length);
-        unsigned char *IDAT_Buf = malloc(data_length); // buffer for holding IDAT chunk
-        memcpy(IDAT_Buf, pic + 41, data_length);       // read idat info
-        unsigned long decompressed_bytes = (curr_height * (width * 4 + 1));
-        unsigned char *uncompressed_buff = malloc(decompressed_bytes); // for holding decompressed data
-        mem_inf(uncompressed_buff, &decompressed_bytes, IDAT_Buf, data_length);
-        pthread_mutex_lock(&shared_mem->lock); // write decompressed IDAT to big buffer after locking
-        memcpy(shared_mem->buffer + (decompressed_bytes * temp->seq), uncompressed_buff, decompressed_bytes);
-        shared_mem->total_IDAT_compress_length += data_length;
-        // printf("inflated img %d to big buff\n", temp->seq);
-        pthread_mutex_unlock(&shared_mem->lock);
-        if (placeholder->new_img_count < B) // if new images have been read, tell producer to give more
+        if (drained) // closed and nothing left
         {
-            sem_post(&shared_mem->spaces);
+            return -1;
         }
+        first = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    }
+}
 
-        // free mallocs
-        free(IDAT_Buf);
-        free(uncompressed_buff);
-        free(pic);
+/**
+ * @brief  take count fragments claimed with claim_fragments off the jobs'
+ *         canvases. Every call starts at the next canvas round and takes
+ *         what it can from each in turn, so the images being stitched share
+ *         the producers evenly, not in the order they were posted, and one
+ *         image's slow tail doesn't hold the others back.
+ * @param  int *slots set to the canvas of each fragment
+ * @param  int *fragments set to each fragment's number in its job
+ */
+void pick_fragments(shared *shared_mem, int count, int *slots, int *fragments)
+{
+    int slot = __atomic_fetch_add(&shared_mem->claim_turn, 1, __ATOMIC_RELAXED) % shared_mem->slots;
+    // claimed fragments are in some canvas for sure, post_job sets it up before counting them
+    while (count > 0)
+    {
+        canvas *cv = shared_mem->canvases + slot;
+        uint64_t c = __atomic_load_n(&cv->claims, __ATOMIC_ACQUIRE);
+        int take = min(count, CLAIMS_FRAGMENTS(c) - CLAIMS_TAKEN(c));
+        // the post count in the word makes sure it is still the job band_of is for
+        if (take > 0 && __atomic_compare_exchange_n(&cv->claims, &c, c + take, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            for (int i = 0; i < take; i++)
+            {
+                *slots++ = slot;
+                *fragments++ = CLAIMS_TAKEN(c) + i;
+            }
+            count -= take;
+        }
+        else if (take <= 0)
+        {
+            slot = (slot + 1) % shared_mem->slots;
+        }
     }
 }
 
-int main(int argc, char **argv)
+enum fetch_state
 {
-    int B = atoi(argv[1]); // buffer size
-    int P = atoi(argv[2]); // producers
-    int C = atoi(argv[3]); // consumers
-    int X = atoi(argv[4]); // consumer sleep time
-    int N = atoi(argv[5]); // image #
+    FETCH_RUNNING, // in the multi handle
+    FETCH_WAITING, // backing off before the next attempt
+    FETCH_DONE,
+    FETCH_FAILED, // given up, the consumers get an empty record for it
+};
 
-    pid_t cpids[P + C];
-    pid_t pid = 0;
+// one fragment download in a producer's multi handle
+typedef struct fetch
+{
+    CURL *easy; // kept for the producer's life, the multi handle reuses its connections
+    RECV_BUF recv_buf;
+    int host; // backend, 0 to NUM_HOSTS - 1
+    enum host_proto proto;
+    int slot;
+    int image;
+    int part;
+    int attempt; // tries so far
+    int admitted; // backend the limits let the next attempt go to, -1 for none yet
+    enum fetch_state state;
+    arena *mem; // the producer's, recv_buf comes from it
+    uint64_t due; // ms, when a waiting fetch goes again
+    char url[256];
+} fetch;
 
-    int shmid = shmget(IPC_PRIVATE, sizeof(struct shared), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    if (shmid == -1)
+/**
+ * @brief  set up an easy handle for a fragment, speaking proto to its backend
+ */
+void fetch_setup(fetch *f, enum host_proto proto)
+{
+    recv_buf_cleanup(&f->recv_buf); // left from the last attempt
+    recv_buf_init(&f->recv_buf, BUF_SIZE, f->mem);
+    curl_easy_setopt(f->easy, CURLOPT_URL, f->url);
+    curl_easy_setopt(f->easy, CURLOPT_FRESH_CONNECT, 0L);
+    f->proto = proto;
+    switch (proto)
     {
-        perror("shmget");
+    case PROTO_H1:
+        curl_easy_setopt(f->easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+        curl_easy_setopt(f->easy, CURLOPT_PIPEWAIT, 0L);
+        break;
+    case PROTO_H2C:
+    case PROTO_H2C_SEEN:
+        curl_easy_setopt(f->easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        curl_easy_setopt(f->easy, CURLOPT_PIPEWAIT, 1L); // wait for the connection in use instead of opening another
+        break;
+    case PROTO_H2_UPGRADE:
+        curl_easy_setopt(f->easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+        curl_easy_setopt(f->easy, CURLOPT_PIPEWAIT, 1L);
+        break;
     }
-    void *share_at = shmat(shmid, NULL, 0);
-    if (share_at == (void *)-1)
+}
+
+/**
+ * @brief  start the next attempt of a fragment on the first backend, from its own on, whose
+ *         breaker lets it through; retries move on to the next backend
+ */
+void fetch_start(shared *shared_mem, CURLM *multi, fetch *f, struct curl_slist **dns, uint64_t now)
+{
+    int preferred = (f->part + f->image + f->attempt) % NUM_HOSTS;
+    // a fetch back from a limiter wait goes where it was admitted, it may hold a breaker's trial
+    f->host = breaker_pick(shared_mem->breakers, NUM_HOSTS, preferred, f->admitted, now);
+    if (f->host < 0) // every backend is failing, check again when a breaker may let a trial through
     {
-        perror("shmat");
-        abort();
+        f->state = FETCH_WAITING;
+        f->due = now + BREAKER_COOLDOWN / 4;
+        return;
     }
-    shared *share = (shared *)share_at;
-    share->total_IDAT_compress_length = 0;
-    share->images_downloaded = 0;
-    share->images_processed = 0;
-
-    // CIRCLEQ_HEAD(ring_buffer, recv_chunk) head;
-    // need to track max and current size - struct?
-
-    int shmid_ring = shmget(IPC_PRIVATE, sizeof(ring_buff) + B * sizeof(img_data), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    if (shmid_ring == -1)
+    if (f->admitted != f->host)
     {
-        perror("shmget");
+        // the request counts against the backend's limits and the global ones, and waits
+        // while any of them is short, including bytes taken by responses already in
+        uint64_t now_ns = tbucket_clock_ns();
+        int64_t wait = max(tbucket_reserve(&shared_mem->req_limit, 1, now_ns),
+                           tbucket_reserve(shared_mem->host_req_limit + f->host, 1, now_ns));
+        wait = max(wait, max(tbucket_delay(&shared_mem->byte_limit, now_ns),
+                             tbucket_delay(shared_mem->host_byte_limit + f->host, now_ns)));
+        f->admitted = f->host;
+        if (wait > 0)
+        {
+            __atomic_add_fetch(&shared_mem->limit_waits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&shared_mem->limit_wait_ns, wait, __ATOMIC_RELAXED);
+            f->state = FETCH_WAITING;
+            f->due = now + (wait + 999999) / 1000000;
+            return;
+        }
     }
-    void *start_ring = shmat(shmid_ring, NULL, 0);
-    if (start_ring == (void *)-1)
+    f->admitted = -1;
+    if (f->attempt++ == 0)
     {
-        perror("shmat");
-        abort();
+        retry_budget_request(&shared_mem->budget);
     }
+    /* specify URL to get */
+    sprintf(f->url, "http://" HOST_NAME ":%d/image?img=%d&part=%d", f->host + 1, HOST_PORT, f->image, f->part);
+    fetch_setup(f, __atomic_load_n(shared_mem->host_proto + f->host, __ATOMIC_RELAXED));
+    // the parent's addresses, curl only looks the name up itself if it never resolved
+    curl_easy_setopt(f->easy, CURLOPT_RESOLVE, dns[f->host]);
+    f->state = FETCH_RUNNING;
+    __atomic_add_fetch(&shared_mem->host_stats[f->host].inflight, 1, __ATOMIC_RELAXED);
+    curl_multi_add_handle(multi, f->easy);
+}
 
-    // initialize ring buffer
-    ring_buff *shared_ring = (ring_buff *)start_ring;
-    shared_ring->new_img_count = 0;
-    shared_ring->cons_it = 0;
-    shared_ring->prod_it = 0;
-    shared_ring->img_data = (img_data *)(start_ring + sizeof(ring_buff)); // set address after shared struct
-    for (int i = 0; i < B; i++)
+/**
+ * @brief  count a finished transfer and how long it took in its backend's metrics
+ */
+void record_request(shared *shared_mem, fetch *f, int ok)
+{
+    host_stats *hs = shared_mem->host_stats + f->host;
+    curl_off_t us = 0;
+    int b = 0;
+    curl_easy_getinfo(f->easy, CURLINFO_TOTAL_TIME_T, &us);
+    while (b < LATENCY_BUCKETS && us > latency_bounds_us[b])
     {
-        img_data *temp = shared_ring->img_data + i;
-        temp->seq = -1;
-        temp->size = 0;
+        b++;
     }
+    __atomic_add_fetch(&hs->latency[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hs->latency_us, (long)us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hs->failures, !ok, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hs->requests, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&hs->inflight, 1, __ATOMIC_RELAXED);
+}
 
-    // if time add error check for everything below
-    if (sem_init(&share->spaces, 1, B) != 0)
-    {
-        perror("sem_init");
-        abort();
-    }; // 1 = shared between processes should be 1, B;
-    if (sem_init(&share->items, 1, 0) != 0)
+/**
+ * @brief  failures worth another attempt: the network, timeouts, and server errors that
+ *         aren't about the request itself
+ */
+int retryable(CURLcode res, long http_code)
+{
+    if (res == CURLE_HTTP_RETURNED_ERROR)
     {
-        perror("sem_init");
-        abort();
-    };
+        return http_code >= 500 || http_code == 408 || http_code == 429;
+    }
+    return res != CURLE_URL_MALFORMAT && res != CURLE_UNSUPPORTED_PROTOCOL && res != CURLE_OUT_OF_MEMORY &&
+           res != CURLE_WRITE_ERROR;
+}
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&share->lock, &attr);
+/**
+ * @brief  errors a server that doesn't speak HTTP/2 answers a prior knowledge request with
+ */
+int no_h2c(CURLcode res)
+{
+    return res == CURLE_HTTP2 || res == CURLE_HTTP2_STREAM || res == CURLE_SEND_ERROR || res == CURLE_RECV_ERROR ||
+           res == CURLE_GOT_NOTHING || res == CURLE_WEIRD_SERVER_REPLY;
+}
 
-    double times[2];
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) != 0)
+void producer(shared *shared_mem, ringq *ring)
+{
+    perf_sample life, stage;
+    if (shared_mem->perf)
     {
-        perror("gettimeofday");
-        abort();
+        perf_open(&perf_self);
+    }
+    stage_begin(&life);
+    fetch *fetches = calloc(shared_mem->claim_batch, sizeof(fetch)); // one per claimed fragment
+    // receive buffers go back to it after every batch and come back out warm for the next
+    arena mem;
+    arena_init(&mem);
+    ringq_rec *recs = malloc(shared_mem->claim_batch * sizeof(ringq_rec));
+    int *proto = shared_mem->host_proto; // what every producer speaks to each backend
+    unsigned int seed = getpid() ^ (unsigned int)twheel_clock_ms(); // backoff jitter
+    struct curl_slist *dns[NUM_HOSTS] = {NULL}; // CURLOPT_RESOLVE entry of each backend
+    unsigned int dns_gen[NUM_HOSTS];          // generation dns was built from
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        dns_gen[h] = 1; // odd, never a published generation
     }
-    times[0] = (tv.tv_sec) + tv.tv_usec / 1000000.;
 
-    for (int i = 0; i < P; i++)
+    /* the claimed batch is downloaded at once; over HTTP/2 it shares one connection per backend */
+    CURLM *multi = NULL;
+    int stale = 1; // connections in multi's cache may be half open prior knowledge ones
+
+    for (int i = 0; i < shared_mem->claim_batch; i++)
     {
-        // pid[i] = fork();
-        pid = fork();
-        if (pid > 0)
-        {
-            cpids[i] = pid;
-        }
-        else if (pid == 0)
-        {
-            producer(share, shared_ring, N, B);
-            // shmdt(share_at);
-            // shmdt(start_ring);
-            exit(0);
-        }
-        else
+        CURL *curl_handle = curl_easy_init();
+        if (curl_handle == NULL)
         {
-            perror("fork");
-            abort();
+            fprintf(stderr, "curl_easy_init: returned NULL\n");
+            return;
         }
+        fetches[i].easy = curl_handle;
+        fetches[i].mem = &mem;
+
+        // set DNS cache, for a backend the parent couldn't resolve
+        curl_easy_setopt(curl_handle, CURLOPT_DNS_CACHE_TIMEOUT, 60L); // Cache DNS for 60 seconds
+
+        /* register write call back function to process received data */
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3);
+
+        /* register header call back function to process received header data */
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl);
+
+        /* user defined data structure passed to the call back functions */
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&fetches[i].recv_buf);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&fetches[i].recv_buf);
+        curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, (void *)(fetches + i));
+
+        /* some servers requires a user-agent field */
+        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+        // a hung server or lost connection costs one attempt, not the producer
+        curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, shared_mem->request_timeout);
+        curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, shared_mem->request_timeout < 3000 ? shared_mem->request_timeout : 3000);
+        curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L); // HTTP errors are failures, not fragments
     }
 
-    // consumers:
-    for (int i = P; i < P + C; i++)
+    while (1)
     {
-        pid = fork();
-        if (pid > 0)
+        int batch_left = 0;
+        // break out of loop once every job's fragments are claimed
+        if (claim_fragments(shared_mem, &shared_mem->images_downloaded, &batch_left, 1) < 0)
         {
-            cpids[i] = pid;
+            break;
         }
-        else if (pid == 0)
+
+        if (stale)
         {
-            consumer(share, shared_ring, X, B);
-            // shmdt(share_at);
-            // shmdt(start_ring);
-            exit(0);
+            // drop every cached connection, nothing is in flight between batches
+            if (multi != NULL)
+            {
+                curl_multi_cleanup(multi);
+            }
+            multi = curl_multi_init();
+            if (multi == NULL)
+            {
+                // the batch is claimed already, it is given up below and the next one tries again
+                fprintf(stderr, "curl_multi_init: returned NULL\n");
+            }
+            else
+            {
+                curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+                stale = 0;
+            }
         }
-        else
+
+        // pick up addresses the parent refreshed; nothing is in flight, so no
+        // transfer still holds on to an old list
+        for (int h = 0; h < NUM_HOSTS; h++)
         {
-            perror("fork");
-            abort();
+            if (resolver_gen(&shared_mem->dns, h) != dns_gen[h])
+            {
+                char line[RESOLVER_LINE];
+                dns_gen[h] = resolver_read(&shared_mem->dns, h, line, sizeof(line));
+                curl_slist_free_all(dns[h]);
+                dns[h] = line[0] != '\0' ? curl_slist_append(NULL, line) : NULL;
+            }
         }
-    }
-
-    int state;
 
-    // parent waits for prod and consumer to be done
-    if (pid > 0)
-    {
-        for (int i = 0; i < P; i++)
+        // start the whole batch. The jobs were set up before their fragments could be
+        // claimed and stay put until those are all in, so no lock is needed.
+        stage_begin(&stage);
+        int nfetch = 0;
+        uint64_t now = twheel_clock_ms();
+        int slots[batch_left];
+        int picked[batch_left];
+        pick_fragments(shared_mem, batch_left, slots, picked);
+        for (int i = 0; i < batch_left; i++)
         {
-            waitpid(cpids[i], &state, 0);
+            canvas *cv = shared_mem->canvases + slots[i];
+            fetch *f = fetches + nfetch++;
+            f->slot = slots[i];
+            f->image = cv->image;
+            f->part = cv->band_of[picked[i]];
+            f->attempt = 0;
+            f->admitted = -1;
+            if (multi == NULL)
+            {
+                fprintf(stderr, "image %d part %d: giving up, no transfer could be set up\n", f->image, f->part);
+                f->state = FETCH_FAILED;
+                continue;
+            }
+            fetch_start(shared_mem, multi, f, dns, now);
         }
 
-        for (int i = P; i < P + C; i++)
+        /* get them! retrying failures, then publish them to the ring in one go */
+        int unsettled = multi != NULL ? nfetch : 0;
+        while (unsettled > 0)
         {
-            waitpid(cpids[i], &state, 0);
-        }
+            int running;
+            curl_multi_perform(multi, &running);
+            CURLMsg *msg;
+            int msgs_left;
+            now = twheel_clock_ms();
+            while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL)
+            {
+                if (msg->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+                fetch *f;
+                CURLcode res = msg->data.result;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&f);
+                curl_multi_remove_handle(multi, f->easy);
 
-        // concatenate image after grabbing all segments
-        unsigned char header[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A}; // png header
-
-        FILE *pngptr = fopen("all.png", "wb"); // create all.png file
-        fwrite(header, 8, 1, pngptr);          // write header
-        int IHDR_size = htonl(13);
-        fwrite(&IHDR_size, 4, 1, pngptr); // put in length
-        fwrite("IHDR", 4, 1, pngptr);     // write type
-        unsigned int new_height = htonl(300);
-        unsigned int new_width = htonl(400);
-        fwrite(&new_width, 4, 1, pngptr); // put in height and width
-        fwrite(&new_height, 4, 1, pngptr);
-        unsigned char IHDR_Dat[5] = {8, 6, 0, 0, 0}; // rest of IHDR data
-        fwrite(IHDR_Dat, 5, 1, pngptr);
-        unsigned char IHDR_Buf[17]; // buffer for calculating crc
-        memcpy(IHDR_Buf, "IHDR", 4);
-        memcpy(IHDR_Buf + 4, &new_width, 4);
-        memcpy(IHDR_Buf + 8, &new_height, 4);
-        memcpy(IHDR_Buf + 12, IHDR_Dat, 5);
-        unsigned long IHDR_crc = htonl(crc(IHDR_Buf, 17)); // crc calculation
-        fwrite(&IHDR_crc, 4, 1, pngptr);                   // write crc
-
-        unsigned char *IDAT_Def = malloc(share->total_IDAT_compress_length);
-        unsigned long temp_length = share->total_IDAT_compress_length;
-        // char temp_buff[300 * (400 * 4 + 1)];
-        // memcpy(temp_buff, share->buffer)
-        mem_def(IDAT_Def, &temp_length, share->buffer, (300 * (400 * 4 + 1)), -1); // default compression
-
-        // Writing IDAT
-        unsigned long IDAT_length = htonl(temp_length);
-        fwrite(&IDAT_length, 4, 1, pngptr);                             // write length of IDAT
-        fwrite("IDAT", 4, 1, pngptr);                                   // write IDAT type
-        fwrite(IDAT_Def, temp_length, 1, pngptr); // write the compressed IDAT data
-        unsigned char IDAT_Buf[temp_length + 4];  // for crc calculations
-        memcpy(IDAT_Buf, "IDAT", 4);                                    // copy type and data into buffer
-        memcpy(IDAT_Buf + 4, IDAT_Def, temp_length);
-        unsigned int IDAT_crc = htonl(crc(IDAT_Buf, (temp_length + 4)));
-        fwrite(&IDAT_crc, 4, 1, pngptr); // write crc
-        free(IDAT_Def);
+                // what came in counts against the byte limits, failed or not
+                curl_off_t got = 0;
+                curl_easy_getinfo(f->easy, CURLINFO_SIZE_DOWNLOAD_T, &got);
+                uint64_t now_ns = tbucket_clock_ns();
+                tbucket_reserve(&shared_mem->byte_limit, got, now_ns);
+                tbucket_reserve(shared_mem->host_byte_limit + f->host, got, now_ns);
 
-        int IEND_len = htonl(0); // length of IEND
-        fwrite(&IEND_len, 4, 1, pngptr);
-        fwrite("IEND", 4, 1, pngptr); // write type of IEND
-        unsigned char IEND_Buf[4];
-        memcpy(IEND_Buf, "IEND", 4); // for CRC calculation
-        unsigned int IEND_crc = htonl(crc(IEND_Buf, 4));
-        fwrite(&IEND_crc, 4, 1, pngptr);
-        fclose(pngptr);
+                // first producer to find the backend doesn't take prior knowledge switches everyone over,
+                // unless it answered over HTTP/2 before and this is just a failed transfer
+                int expected = PROTO_H2C;
+                if (res != CURLE_OK && f->proto == PROTO_H2C && no_h2c(res) &&
+                    (__atomic_compare_exchange_n(proto + f->host, &expected, PROTO_H2_UPGRADE, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+                     expected == PROTO_H2_UPGRADE))
+                {
+                    if (expected == PROTO_H2C)
+                    {
+                        fprintf(stderr, "ece252-%d: no HTTP/2 with prior knowledge, offering an upgrade instead\n", f->host + 1);
+                    }
+                    fetch_setup(f, PROTO_H2_UPGRADE);
+                    // not over another prior knowledge connection still in the cache
+                    curl_easy_setopt(f->easy, CURLOPT_FRESH_CONNECT, 1L);
+                    curl_multi_add_handle(multi, f->easy);
+                    stale = 1;
+                    continue;
+                }
 
-        if (gettimeofday(&tv, NULL) != 0)
-        {
-            perror("gettimeofday");
-            abort();
-        }
-        times[1] = (tv.tv_sec) + tv.tv_usec / 1000000.;
-        printf("paster2 execution time: %.6lf seconds\n", times[1] - times[0]);
+                long http_code = 0;
+                curl_easy_getinfo(f->easy, CURLINFO_RESPONSE_CODE, &http_code);
+                const char *why = curl_easy_strerror(res);
+                if (res == CURLE_OK && f->recv_buf.seq != f->part) // answered, but not with our fragment
+                {
+                    res = CURLE_WEIRD_SERVER_REPLY;
+                    why = "no matching fragment header";
+                }
+                breaker_result(shared_mem->breakers + f->host, res == CURLE_OK, now);
+                record_request(shared_mem, f, res == CURLE_OK);
+                if (res == CURLE_OK)
+                {
+                    long version = 0;
+                    curl_easy_getinfo(f->easy, CURLINFO_HTTP_VERSION, &version);
+                    if (version == CURL_HTTP_VERSION_2_0 && f->proto == PROTO_H2C)
+                    {
+                        // it does speak h2c, stop falling back on errors from here on
+                        __atomic_store_n(proto + f->host, PROTO_H2C_SEEN, __ATOMIC_RELAXED);
+                    }
+                    f->state = FETCH_DONE;
+                    unsettled--;
+                }
+                else if (retryable(res, http_code) && f->attempt < shared_mem->max_attempts &&
+                         retry_budget_take(&shared_mem->budget))
+                {
+                    f->state = FETCH_WAITING;
+                    f->due = now + retry_backoff_ms(f->attempt, &seed);
+                }
+                else
+                {
+                    fprintf(stderr, "image %d part %d: giving up after %d attempts: %s\n", f->image, f->part, f->attempt, why);
+                    f->state = FETCH_FAILED;
+                    unsettled--;
+                }
+            }
 
-        sem_destroy(&share->spaces);
-        sem_destroy(&share->items);
-        pthread_mutexattr_destroy(&attr);
-        pthread_mutex_destroy(&share->lock);
-        if (shmdt(share_at) != 0)
-        {
-            perror("shmdt");
-            abort();
+            // start the retries that are due, and sleep no longer than until the next one
+            long timeout = 1000;
+            for (int i = 0; i < nfetch; i++)
+            {
+                fetch *f = fetches + i;
+                if (f->state == FETCH_WAITING && f->due <= now)
+                {
+                    fetch_start(shared_mem, multi, f, dns, now);
+                }
+                if (f->state == FETCH_WAITING && (long)(f->due - now) < timeout)
+                {
+                    timeout = f->due - now;
+                }
+            }
+            if (unsettled > 0)
+            {
+                curl_multi_poll(multi, NULL, 0, timeout, NULL);
+            }
         }
-        if (shmctl(shmid, IPC_RMID, NULL) == -1)
+        stage_end(shared_mem, STAGE_FETCH, &stage);
+
+        // a fragment given up on still goes in, empty, so the consumers that claimed it and
+        // the parent waiting for its band don't wait forever
+        for (int i = 0; i < nfetch; i++)
         {
-            perror("shmctl");
-            abort();
+            fetch *f = fetches + i;
+            recs[i].data = (unsigned char *)f->recv_buf.buf;
+            recs[i].size = f->state == FETCH_DONE ? f->recv_buf.size : 0;
+            recs[i].seq = f->part; // store img sequence number
+            recs[i].slot = f->slot;
         }
-        if (shmdt(start_ring) != 0)
+        stage_begin(&stage);
+        for (int done = 0; done < nfetch;)
         {
-            perror("shmdt");
-            abort();
+            done += ringq_push(ring, recs + done, nfetch - done);
+            if (done < nfetch)
+            {
+                fprintf(stderr, "fragment of %zu bytes is larger than the ring (%zu bytes), dropped\n",
+                        recs[done].size, ring->byte_budget);
+                recs[done].size = 0;
+            }
         }
-        if (shmctl(shmid_ring, IPC_RMID, NULL) == -1)
+        stage_end(shared_mem, STAGE_PUBLISH, &stage);
+        for (int i = 0; i < nfetch; i++)
         {
-            perror("shmctl");
-            abort();
+            recv_buf_cleanup(&fetches[i].recv_buf);
         }
     }
-    return 0;
-}
\ No newline at end of file
+    /* cleaning up */
+    for (int i = 0; i < shared_mem->claim_batch; i++)
+    {
+        curl_easy_cleanup(fetches[i].easy);
+    }
+    curl_multi_cleanup(multi);
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        curl_slist_free_all(dns[h]);
+    }
+    free(fetches);
+    free(recs);
+    arena_stats_add(&shared_mem->producer_mem, &mem.stats);
+    arena_destroy(&mem);
+    stage_end(shared_mem, STAGE_PRODUCER, &life);
+    perf_close(&perf_self);
+}
+
+/**
+ * @brief  tell the parent that a band landed or a consumer left
+ */
+void notify_parent(shared *shared_mem)
+{
+    uint64_t one = 1;
+    if (write(shared_mem->band_efd, &one, sizeof(one)) != sizeof(one))
+    {
+        perror("write eventfd");
+    }
+}
+
+/**
+ * @brief  where band of a canvas starts in canvas_seg, when canvases are file backed
+ */
+size_t band_offset(shared *shared_mem, canvas *cv, int band)
+{
+    return cv->buffer - (unsigned char *)shared_mem->canvas_seg.addr + BAND_BYTES(&cv->geo) * band;
+}
+
+/**
+ * @brief  count a fragment as done with, outcome being the metrics counter
+ *         it goes to. Stitched or not, the parent stops waiting for the job
+ *         once every fragment got here.
+ */
+void settle_fragment(shared *shared_mem, canvas *cv, long *outcome)
+{
+    __atomic_add_fetch(outcome, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cv->bands_settled, 1, __ATOMIC_RELEASE);
+    notify_parent(shared_mem);
+}
+
+/**
+ * @brief  inflate a fragment and put its rows into its job's canvas. The
+ *         fragment may be RGBA8, RGB8, GRAY8 or RGBA16, its rows are turned
+ *         into the canvas's RGBA8 by the copy made for that format and width.
+ */
+void process_fragment(shared *shared_mem, arena *mem, z_stream *strm, int seq, canvas *cv, char *pic, size_t pic_size)
+{
+    // inflate img data
+    unsigned int curr_height = 0;
+    unsigned int width = 0;
+    unsigned int data_length = 0;
+    int fmt = PIXFMT_UNKNOWN;
+    if (pic_size >= 41) // signature, IHDR and the IDAT length and type
+    {
+        memcpy(&width, pic + 16, 4); // fragment IHDR width and height
+        memcpy(&curr_height, pic + 20, 4);
+        width = ntohl(width);
+        curr_height = ntohl(curr_height);
+        if (pic[28] == 0) // not interlaced
+        {
+            fmt = pixfmt_from_ihdr(pic[24], pic[25]); // bit depth, color type
+        }
+        memcpy(&data_length, pic + 33, 4); // read compressed data length
+        data_length = htonl(data_length);
+    }
+    unsigned char *IDAT_Buf = (unsigned char *)pic + 41; // IDAT data, right after IHDR
+    int bpp = fmt != PIXFMT_UNKNOWN ? pixfmt_bpp(fmt) : 4;
+    unsigned long stride = (unsigned long)cv->geo.width * bpp + 1; // the fragment's scanlines
+    unsigned long expected = cv->geo.band_height * stride;
+    unsigned long decompressed_bytes = expected;
+    unsigned char *uncompressed_buff = arena_alloc(mem, decompressed_bytes); // for holding decompressed data
+    long *outcome = &shared_mem->fragments_dropped; // what the metrics count it as
+    perf_sample stage;
+    stage_begin(&stage);
+    if (pic_size == 0)
+    {
+        // a producer gave up on it and said so already
+        outcome = &shared_mem->fragments_lost;
+    }
+    else if (seq < 0 || seq >= (int)cv->geo.bands || width != cv->geo.width || curr_height != cv->geo.band_height ||
+        pic_size < 41 || 41 + (size_t)data_length > pic_size)
+    {
+        fprintf(stderr, "fragment %d: doesn't match the job's geometry, dropped\n", seq);
+    }
+    else if (uncompressed_buff == NULL)
+    {
+        fprintf(stderr, "fragment %d: out of memory, dropped\n", seq);
+    }
+    else if (fmt == PIXFMT_UNKNOWN)
+    {
+        fprintf(stderr, "fragment %d: unsupported pixel format, dropped\n", seq);
+    }
+    else if (mem_inf_z(strm, uncompressed_buff, &decompressed_bytes, IDAT_Buf, data_length) != Z_OK ||
+             decompressed_bytes != expected)
+    {
+        fprintf(stderr, "fragment %d: bad IDAT data, dropped\n", seq);
+    }
+    // undo the fragment's own filters so the rows don't depend on rows of the fragment above
+    else if (png_unfilter_rows(uncompressed_buff, curr_height, stride - 1, bpp) != 0)
+    {
+        fprintf(stderr, "fragment %d: bad scanline filter, dropped\n", seq);
+    }
+    else
+    {
+        stage_end(shared_mem, STAGE_INFLATE, &stage);
+        stage_begin(&stage);
+        // each band has its own part of the canvas, no lock needed to write it
+        pixfmt_copy_rows(cv->buffer + BAND_BYTES(&cv->geo) * seq, ROW_BYTES(&cv->geo), uncompressed_buff, stride, fmt,
+                         width, curr_height);
+        stage_end(shared_mem, STAGE_COPY, &stage);
+        if (shared_mem->canvas_seg.fd >= 0)
+        {
+            // out of core, the rows stay in the page cache for the parent but leave this
+            // process, so they can go to disk once the parent is done with them
+            shm_seg_evict(&shared_mem->canvas_seg, band_offset(shared_mem, cv, seq), BAND_BYTES(&cv->geo), SHM_EVICT_UNMAP);
+        }
+        outcome = &shared_mem->fragments_stitched;
+        __atomic_fetch_add(&cv->total_IDAT_compress_length, data_length, __ATOMIC_RELAXED);
+        __atomic_store_n(&cv->band_done[seq], 1, __ATOMIC_RELEASE); // after the pixels
+        // printf("inflated img %d to big buff\n", seq);
+    }
+
+    // free mallocs
+    arena_free(mem, uncompressed_buff);
+    settle_fragment(shared_mem, cv, outcome);
+}
+
+// a fragment taken off the ring, waiting out the consumer delay
+typedef struct pending
+{
+    twheel_timer timer;
+    int seq;
+    int slot;
+    size_t size;
+    char pic[]; // fragment bytes
+} pending;
+
+/**
+ * @brief  take fragments off the ring and stitch each into its canvas x ms
+ *         after it was taken. Up to inflight fragments wait out their delay
+ *         at once on a timer wheel instead of the consumer sleeping on each.
+ */
+void consumer(shared *shared_mem, ringq *ring, int x)
+{
+    // fragment copies, band scratch and zlib's state all come from here and go back per
+    // fragment, so the same few buffers are used over and over
+    arena mem;
+    arena_init(&mem);
+    perf_sample life;
+    if (shared_mem->perf)
+    {
+        perf_open(&perf_self);
+    }
+    stage_begin(&life);
+
+    // one inflate stream for the consumer's whole life, reset per fragment
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    strm.zalloc = arena_zalloc;
+    strm.zfree = arena_zfree;
+    strm.opaque = &mem;
+    if (inflateInit(&strm) != Z_OK)
+    {
+        fprintf(stderr, "inflateInit failed\n");
+        abort();
+    }
+    // fragments taken off the ring in one go, and their bytes
+    ringq_rec *recs = malloc(shared_mem->claim_batch * sizeof(ringq_rec));
+    unsigned char *pics = malloc(ring->byte_budget);
+    twheel wheel;
+    twheel_init(&wheel, 1, twheel_clock_ms());
+
+    int batch_left = 0;
+    int drained = 0; // no more fragments to claim, ever
+    while (!drained || wheel.count > 0)
+    {
+        // claim more while there's room, sleeping for a job only with nothing in processing
+        if (batch_left == 0 && !drained && wheel.count < shared_mem->inflight &&
+            claim_fragments(shared_mem, &shared_mem->images_processed, &batch_left, wheel.count == 0) == -1)
+        {
+            drained = 1; // break out once every job's fragments are claimed and processed
+        }
+
+        uint64_t now = twheel_clock_ms();
+        int room = shared_mem->inflight - wheel.count;
+        if (batch_left > 0 && room > 0)
+        {
+            // take claimed fragments off the ring, but don't sleep past the next deadline
+            int n = ringq_pop(ring, recs, batch_left < room ? batch_left : room, pics, ring->byte_budget,
+                              twheel_next(&wheel, now));
+            now = twheel_clock_ms();
+            for (int i = 0; i < n; i++)
+            {
+                pending *pd = arena_alloc(&mem, sizeof(pending) + recs[i].size);
+                if (pd == NULL)
+                {
+                    fprintf(stderr, "fragment %d: out of memory, dropped\n", recs[i].seq);
+                    settle_fragment(shared_mem, shared_mem->canvases + recs[i].slot, &shared_mem->fragments_dropped);
+                    continue;
+                }
+                pd->seq = recs[i].seq;
+                pd->slot = recs[i].slot;
+                pd->size = recs[i].size;
+                memcpy(pd->pic, recs[i].data, recs[i].size);
+                pd->timer.arg = pd;
+                twheel_add(&wheel, &pd->timer, now + x); // x ms of "processing" from now
+                __atomic_add_fetch(&shared_mem->fragments_delayed, 1, __ATOMIC_RELAXED);
+            }
+            batch_left -= n;
+        }
+        else if (wheel.count > 0)
+        {
+            long wait = twheel_next(&wheel, now); // full, or nothing claimable yet
+            if (wait > 0)
+            {
+                usleep(wait * 1000); // sleep in microseconds, *1000 for milli
+            }
+        }
+
+        for (twheel_timer *t = twheel_expire(&wheel, twheel_clock_ms()); t != NULL;)
+        {
+            pending *pd = t->arg;
+            t = t->next;
+            __atomic_sub_fetch(&shared_mem->fragments_delayed, 1, __ATOMIC_RELAXED);
+            process_fragment(shared_mem, &mem, &strm, pd->seq, shared_mem->canvases + pd->slot, pd->pic, pd->size);
+            arena_free(&mem, pd);
+        }
+    }
+    inflateEnd(&strm);
+    free(recs);
+    free(pics);
+    arena_stats_add(&shared_mem->consumer_mem, &mem.stats);
+    arena_destroy(&mem);
+    stage_end(shared_mem, STAGE_CONSUMER, &life);
+    perf_close(&perf_self);
+    __atomic_fetch_add(&shared_mem->consumers_done, 1, __ATOMIC_RELEASE);
+    notify_parent(shared_mem);
+}
+
+/**
+ * @brief  put a job in a free canvas and let the workers at its fragments
+ */
+void post_job(shared *shared_mem, int slot, job *jb)
+{
+    canvas *cv = shared_mem->canvases + slot;
+    memset(cv->band_done, 0, sizeof(cv->band_done));
+    cv->total_IDAT_compress_length = 0;
+    cv->bands_settled = 0;
+    // only the bands with rows in the output are fetched
+    cv->fragments = 0;
+    for (unsigned int b = 0; b < jb->geo.bands; b++)
+    {
+        for (int r = 0; r < jb->ranges; r++)
+        {
+            if (b * jb->geo.band_height <= jb->rows[r].last && (b + 1) * jb->geo.band_height > jb->rows[r].first)
+            {
+                cv->band_of[cv->fragments++] = b;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&shared_mem->lock);
+    cv->image = jb->image;
+    cv->geo = jb->geo;
+    cv->active = 1;
+    __atomic_store_n(&cv->claims, CLAIMS((cv->claims >> 32) + 1, cv->fragments, 0), __ATOMIC_RELEASE);
+    // publish the fragments only after the canvas is set up, see claim_fragments
+    __atomic_store_n(&shared_mem->total_fragments, shared_mem->total_fragments + cv->fragments, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&shared_mem->job_posted);
+    pthread_mutex_unlock(&shared_mem->lock);
+}
+
+/**
+ * @brief  tell the workers no more jobs will be posted, so they exit once
+ *         the posted ones are done
+ */
+void close_jobs(shared *shared_mem)
+{
+    pthread_mutex_lock(&shared_mem->lock);
+    __atomic_store_n(&shared_mem->closed, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&shared_mem->job_posted);
+    pthread_mutex_unlock(&shared_mem->lock);
+}
+
+/**
+ * @brief  send a daemon client its answer and hang up, no-op for batch jobs
+ */
+void reply_job(job *jb, const char *fmt, ...)
+{
+    char msg[512];
+    va_list ap;
+    if (jb->reply_fd < 0)
+    {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (write(jb->reply_fd, msg, strlen(msg)) < 0)
+    {
+        perror("reply");
+    }
+    close(jb->reply_fd);
+    jb->reply_fd = -1;
+}
+
+/**
+ * @brief  open where a job's image goes: its path, stdout or the descriptor
+ *         that came with the request
+ * @return file descriptor, -1 on error
+ */
+int open_output(job *jb)
+{
+    if (jb->out_fd >= 0)
+    {
+        return jb->out_fd;
+    }
+    if (strcmp(jb->output, "-") == 0)
+    {
+        return STDOUT_FILENO;
+    }
+    return open(jb->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+void close_output(job *jb, int fd, int *status)
+{
+    if (fd != STDOUT_FILENO && close(fd) != 0)
+    {
+        perror(jb->output);
+        *status = 1;
+    }
+    jb->out_fd = -1;
+}
+
+/**
+ * @brief  where level factor of a pyramid goes: "out.png" becomes "out_2x.png"
+ */
+void level_path(char *dest, size_t len, const char *output, int factor)
+{
+    size_t n = strlen(output);
+    if (n > 4 && strcmp(output + n - 4, ".png") == 0)
+    {
+        n -= 4;
+    }
+    snprintf(dest, len, "%.*s_%dx.png", (int)n, output, factor);
+}
+
+/**
+ * @brief  open the files of a job's pyramid, levels 2x, 4x ... next to its
+ *         output. A job whose output has no path gets none.
+ */
+void open_pyramid(slot_state *st, int levels, unsigned long idat_chunk)
+{
+    char names[PYR_MAX_LEVELS][sizeof(st->jb.output) + 16];
+    char *paths[PYR_MAX_LEVELS];
+    st->pyr = NULL;
+    if (st->jb.out_fd >= 0 || strcmp(st->jb.output, "-") == 0)
+    {
+        fprintf(stderr, "image %d: no pyramid for output without a path\n", st->jb.image);
+        return;
+    }
+    for (int i = 0; i < levels; i++)
+    {
+        level_path(names[i], sizeof(names[i]), st->jb.output, 2 << i);
+        paths[i] = names[i];
+    }
+    st->pyr = malloc(sizeof(pyramid));
+    if (pyramid_open(st->pyr, st->jb.geo.width, st->out_rows, levels, paths, idat_chunk) != 0)
+    {
+        perror("pyramid");
+        free(st->pyr);
+        st->pyr = NULL;
+    }
+}
+
+/**
+ * @brief  start a job in a free canvas. When streaming, the output is opened
+ *         and gets the signature and IHDR right away. The files of levels
+ *         pyramid levels are opened too, a pyramid that can't be is skipped.
+ * @return 0 on success, 1 if the output can't be opened (job not posted)
+ */
+int start_job(shared *shared_mem, slot_state *st, int slot, job *jb, int streaming, unsigned long idat_chunk, int levels)
+{
+    st->jb = *jb;
+    if (st->jb.ranges == 0)
+    {
+        st->jb.rows[0].first = 0;
+        st->jb.rows[0].last = jb->geo.bands * jb->geo.band_height - 1;
+        st->jb.ranges = 1;
+    }
+    st->out_rows = 0;
+    for (int r = 0; r < st->jb.ranges; r++)
+    {
+        st->out_rows += st->jb.rows[r].last - st->jb.rows[r].first + 1;
+    }
+    png_ihdr ihdr = {jb->geo.width, st->out_rows, 8, 6};
+
+    st->next = 0;
+    st->last_row = -1;
+    st->out_fd = -1;
+    st->filtered = NULL;
+    memset(st->band_mem, BAND_ABSENT, sizeof(st->band_mem));
+    st->discarded = 0;
+    if (streaming)
+    {
+        // signature and IHDR go out right away, IDAT follows the bands
+        st->out_fd = open_output(&st->jb);
+        if (st->out_fd < 0 || png_stream_open(&st->ps, st->out_fd, &ihdr, -1, idat_chunk) != 0)
+        {
+            perror(jb->output);
+            if (st->out_fd >= 0)
+            {
+                int ignored;
+                close_output(&st->jb, st->out_fd, &ignored);
+            }
+            reply_job(&st->jb, "error %s: %s\n", jb->output, strerror(errno));
+            return 1;
+        }
+        st->filtered = malloc(BAND_BYTES(&jb->geo));
+    }
+    st->pyr = NULL;
+    if (levels > 0)
+    {
+        open_pyramid(st, levels, idat_chunk);
+    }
+    st->busy = 1;
+    st->started = now();
+    post_job(shared_mem, slot, &st->jb);
+    return 0;
+}
+
+/**
+ * @brief  filter canvas rows first to first + rows - 1 into dest, the row
+ *         before them in the output being canvas row prev (-1 for none)
+ */
+void filter_canvas_rows(unsigned char *dest, canvas *cv, geometry *geo, unsigned int first, unsigned int rows, int prev)
+{
+    unsigned char *above = prev >= 0 ? cv->buffer + ROW_BYTES(geo) * prev + 1 : NULL; // its pixels
+    png_filter_rows(dest, cv->buffer + ROW_BYTES(geo) * first, above, rows, geo->width * 4, 4, PNG_FILTER_ADAPTIVE);
+}
+
+/**
+ * @brief  take a band of a file backed canvas out of memory, written back or
+ *         with how SHM_EVICT_DISCARD thrown away
+ */
+void evict_band(shared *shared_mem, slot_state *st, int slot, int band, int how)
+{
+    unsigned long bytes = BAND_BYTES(&st->jb.geo);
+    if (st->band_mem[band] == BAND_EVICTED && how != SHM_EVICT_DISCARD)
+    {
+        return;
+    }
+    if (shm_seg_evict(&shared_mem->canvas_seg, band_offset(shared_mem, shared_mem->canvases + slot, band), bytes, how) != 0)
+    {
+        perror("canvas file");
+    }
+    if (st->band_mem[band] == BAND_RESIDENT)
+    {
+        __atomic_sub_fetch(&shared_mem->resident, bytes, __ATOMIC_RELAXED);
+        if (how != SHM_EVICT_DISCARD)
+        {
+            __atomic_add_fetch(&shared_mem->spilled, bytes, __ATOMIC_RELAXED);
+        }
+    }
+    st->band_mem[band] = BAND_EVICTED;
+}
+
+/**
+ * @brief  keep a file backed canvas under the memory ceiling: bands that
+ *         landed count against it, streamed ones are thrown away, and while
+ *         over it the bands needed last are written back to the file
+ */
+void bound_canvas(shared *shared_mem, slot_state *st, int slot)
+{
+    canvas *cv = shared_mem->canvases + slot;
+    for (int i = 0; i < cv->fragments; i++)
+    {
+        int band = cv->band_of[i];
+        if (st->band_mem[band] == BAND_ABSENT && __atomic_load_n(&cv->band_done[band], __ATOMIC_ACQUIRE))
+        {
+            st->band_mem[band] = BAND_RESIDENT;
+            __atomic_add_fetch(&shared_mem->resident, BAND_BYTES(&st->jb.geo), __ATOMIC_RELAXED);
+        }
+    }
+    // the last streamed band stays, the next one is filtered against its last row
+    while (st->out_fd >= 0 && st->discarded < st->next - 1)
+    {
+        evict_band(shared_mem, st, slot, cv->band_of[st->discarded++], SHM_EVICT_DISCARD);
+    }
+    for (int i = cv->fragments - 1; i >= 0 && shared_mem->mem_ceiling > 0 && shared_mem->resident > shared_mem->mem_ceiling;
+         i--)
+    {
+        if (st->band_mem[cv->band_of[i]] == BAND_RESIDENT)
+        {
+            evict_band(shared_mem, st, slot, cv->band_of[i], SHM_EVICT_WRITE);
+        }
+    }
+}
+
+/**
+ * @brief  hand the output rows of the job's next band, fragment st->next,
+ *         to the stream and the pyramid levels, and move on to the one after
+ */
+void emit_band(slot_state *st, canvas *cv)
+{
+    geometry *geo = &st->jb.geo;
+    unsigned int top = cv->band_of[st->next] * geo->band_height;
+    for (int r = 0; (st->out_fd >= 0 || st->pyr != NULL) && r < st->jb.ranges; r++)
+    {
+        // the band's rows in this range
+        unsigned int lo = max(top, st->jb.rows[r].first);
+        unsigned int hi = min(top + geo->band_height - 1, st->jb.rows[r].last);
+        if (lo > hi)
+        {
+            continue;
+        }
+        if (st->pyr != NULL && pyramid_rows(st->pyr, cv->buffer + ROW_BYTES(geo) * lo + 1, ROW_BYTES(geo), hi - lo + 1) != 0)
+        {
+            perror("pyramid");
+        }
+        if (st->out_fd >= 0)
+        {
+            filter_canvas_rows(st->filtered, cv, geo, lo, hi - lo + 1, st->last_row);
+            if (png_stream_rows(&st->ps, st->filtered, (hi - lo + 1) * ROW_BYTES(geo), 0) != 0)
+            {
+                perror(st->jb.output);
+            }
+        }
+        st->last_row = hi;
+    }
+    st->next++;
+}
+
+/**
+ * @brief  move a job forward over the bands that landed since last time.
+ *         When streaming, the output rows of every band are filtered and
+ *         written as soon as all the bands above it are in; the pyramid
+ *         levels get them then too, while they are still in cache.
+ * @return 1 once every band is in, 0 otherwise
+ */
+int advance_job(shared *shared_mem, slot_state *st, int slot)
+{
+    canvas *cv = shared_mem->canvases + slot;
+    int first = st->next;
+    perf_sample stage;
+    stage_begin(&stage);
+
+    while (st->next < cv->fragments && __atomic_load_n(&cv->band_done[cv->band_of[st->next]], __ATOMIC_ACQUIRE))
+    {
+        emit_band(st, cv);
+    }
+    if (st->out_fd >= 0 && st->next > first && st->next < cv->fragments)
+    {
+        // let the reader decode what we have so far
+        if (png_stream_rows(&st->ps, NULL, 0, 1) != 0)
+        {
+            perror(st->jb.output);
+        }
+    }
+    if (st->next > first && (st->out_fd >= 0 || st->pyr != NULL))
+    {
+        stage_end(shared_mem, STAGE_DEFLATE, &stage);
+    }
+    if (shared_mem->canvas_seg.fd >= 0)
+    {
+        bound_canvas(shared_mem, st, slot);
+    }
+    return st->next == cv->fragments;
+}
+
+/**
+ * @brief  write a job's output from a file backed canvas a band at a time,
+ *         compressing as it goes like streaming does, so neither the whole
+ *         filtered image nor its IDAT data is ever in memory; each band is
+ *         thrown away once the rows after it are filtered
+ * @return 0 on success, 1 on error
+ */
+int write_banded(shared *shared_mem, slot_state *st, int slot, png_ihdr *ihdr, unsigned long idat_chunk)
+{
+    canvas *cv = shared_mem->canvases + slot;
+    geometry *geo = &st->jb.geo;
+    unsigned char *filtered = malloc(BAND_BYTES(geo));
+    int fd = open_output(&st->jb);
+    int status = 0;
+    int prev = -1; // output row before the next one, in the canvas
+    png_stream ps;
+    int opened = filtered != NULL && fd >= 0 && png_stream_open(&ps, fd, ihdr, -1, idat_chunk) == 0;
+    if (!opened)
+    {
+        perror(st->jb.output);
+        status = 1;
+    }
+    for (int r = 0; status == 0 && r < st->jb.ranges; r++)
+    {
+        unsigned int lo = st->jb.rows[r].first;
+        while (status == 0 && lo <= st->jb.rows[r].last)
+        {
+            int band = lo / geo->band_height;
+            unsigned int hi = min(st->jb.rows[r].last, (band + 1) * geo->band_height - 1);
+            filter_canvas_rows(filtered, cv, geo, lo, hi - lo + 1, prev);
+            if (prev >= 0 && prev / (int)geo->band_height != band)
+            {
+                // its last row was the one above these
+                evict_band(shared_mem, st, slot, prev / geo->band_height, SHM_EVICT_DISCARD);
+            }
+            if (png_stream_rows(&ps, filtered, (hi - lo + 1) * ROW_BYTES(geo), 0) != 0)
+            {
+                perror(st->jb.output);
+                status = 1;
+            }
+            prev = hi;
+            lo = hi + 1;
+        }
+    }
+    if (opened && png_stream_close(&ps) != 0 && status == 0)
+    {
+        perror(st->jb.output);
+        status = 1;
+    }
+    if (fd >= 0)
+    {
+        close_output(&st->jb, fd, &status);
+    }
+    free(filtered);
+    return status;
+}
+
+/**
+ * @brief  write out a job whose bands are all in (or never will be), answer
+ *         its client and free its canvas
+ * @return 0 on success, 1 if the image is incomplete or could not be written
+ */
+int finish_job(shared *shared_mem, slot_state *st, int slot, unsigned long idat_chunk)
+{
+    canvas *cv = shared_mem->canvases + slot;
+    geometry *geo = &st->jb.geo;
+    png_ihdr ihdr = {geo->width, st->out_rows, 8, 6};
+    int status = 0;
+    perf_sample stage;
+    stage_begin(&stage);
+
+    if (st->next != cv->fragments)
+    {
+        fprintf(stderr, "image %d: band %d never arrived, output is incomplete\n", st->jb.image, cv->band_of[st->next]);
+        status = 1;
+    }
+    // the rest of the bands go out like the ones before them, the missing ones all zero
+    // (transparent) instead of whatever an earlier job in the canvas left there
+    while (st->next < cv->fragments)
+    {
+        int band = cv->band_of[st->next];
+        if (!__atomic_load_n(&cv->band_done[band], __ATOMIC_ACQUIRE))
+        {
+            memset(cv->buffer + BAND_BYTES(geo) * band, 0, BAND_BYTES(geo));
+        }
+        emit_band(st, cv);
+    }
+
+    if (st->pyr != NULL)
+    {
+        if (pyramid_close(st->pyr) != 0)
+        {
+            perror("pyramid");
+            status = 1;
+        }
+        free(st->pyr);
+        st->pyr = NULL;
+    }
+    if (st->out_fd >= 0)
+    {
+        if (png_stream_close(&st->ps) != 0)
+        {
+            perror(st->jb.output);
+            status = 1;
+        }
+        close_output(&st->jb, st->out_fd, &status);
+        free(st->filtered);
+    }
+    else if (shared_mem->canvas_seg.fd >= 0)
+    {
+        status |= write_banded(shared_mem, st, slot, &ihdr, idat_chunk);
+    }
+    else
+    {
+        // canvas rows are unfiltered, pick the best filter per row before compressing
+        unsigned long out_bytes = st->out_rows * ROW_BYTES(geo);
+        unsigned char *filtered = malloc(out_bytes);
+        unsigned char *at = filtered;
+        for (int r = 0; r < st->jb.ranges; r++)
+        {
+            unsigned int rows = st->jb.rows[r].last - st->jb.rows[r].first + 1;
+            filter_canvas_rows(at, cv, geo, st->jb.rows[r].first, rows, r > 0 ? (int)st->jb.rows[r - 1].last : -1);
+            at += rows * ROW_BYTES(geo);
+        }
+        unsigned long temp_length = compressBound(out_bytes);
+        unsigned char *IDAT_Def = malloc(temp_length);
+        mem_def(IDAT_Def, &temp_length, filtered, out_bytes, -1); // default compression
+        free(filtered);
+
+        // signature, IHDR, IDAT(s) and IEND in one write, crc computed over IDAT_Def in place
+        int fd = open_output(&st->jb);
+        if (fd < 0 || png_write_fd(fd, &ihdr, IDAT_Def, temp_length, idat_chunk) != 0)
+        {
+            perror(st->jb.output);
+            status = 1;
+        }
+        if (fd >= 0)
+        {
+            close_output(&st->jb, fd, &status);
+        }
+        free(IDAT_Def);
+    }
+    stage_end(shared_mem, STAGE_DEFLATE, &stage);
+    if (shared_mem->canvas_seg.fd >= 0)
+    {
+        // the next job in the canvas starts from an empty file again
+        for (int i = 0; i < cv->fragments; i++)
+        {
+            evict_band(shared_mem, st, slot, cv->band_of[i], SHM_EVICT_DISCARD);
+        }
+    }
+
+    __atomic_add_fetch(status == 0 ? &shared_mem->jobs_done : &shared_mem->jobs_failed, 1, __ATOMIC_RELAXED);
+    if (status == 0)
+    {
+        reply_job(&st->jb, "ok %d %.6lf\n", st->jb.image, now() - st->started);
+    }
+    else
+    {
+        reply_job(&st->jb, "error image %d incomplete or not written\n", st->jb.image);
+    }
+
+    pthread_mutex_lock(&shared_mem->lock);
+    cv->active = 0;
+    pthread_mutex_unlock(&shared_mem->lock);
+    st->busy = 0;
+    return status;
+}
+
+/**
+ * @brief  parse row ranges "FIRST-LAST,ROW,..." (0 based, both ends included)
+ *         into a job, sorted and with overlapping or touching ranges merged
+ * @return 0 on success, -1 if malformed or too many
+ */
+int parse_ranges(const char *spec, job *jb)
+{
+    jb->ranges = 0;
+    while (*spec != '\0')
+    {
+        row_range rr;
+        int used = 0;
+        if (jb->ranges == MAX_RANGES || sscanf(spec, "%u%n", &rr.first, &used) != 1)
+        {
+            return -1;
+        }
+        spec += used;
+        rr.last = rr.first;
+        if (*spec == '-' && (sscanf(spec + 1, "%u%n", &rr.last, &used) != 1 || rr.last < rr.first))
+        {
+            return -1;
+        }
+        spec += *spec == '-' ? used + 1 : 0;
+        if (*spec != ',' && *spec != '\0')
+        {
+            return -1;
+        }
+        spec += *spec == ',';
+
+        // insert in order, then fold in its neighbours if they meet it
+        int i = jb->ranges++;
+        for (; i > 0 && jb->rows[i - 1].first > rr.first; i--)
+        {
+            jb->rows[i] = jb->rows[i - 1];
+        }
+        jb->rows[i] = rr;
+    }
+    int kept = 0;
+    for (int i = 0; i < jb->ranges; i++)
+    {
+        if (kept > 0 && jb->rows[i].first <= jb->rows[kept - 1].last + 1)
+        {
+            jb->rows[kept - 1].last = max(jb->rows[kept - 1].last, jb->rows[i].last);
+        }
+        else
+        {
+            jb->rows[kept++] = jb->rows[i];
+        }
+    }
+    jb->ranges = kept;
+    return kept > 0 ? 0 : -1;
+}
+
+/**
+ * @brief  cut a job's row ranges down to its image
+ * @return 0 on success, -1 if a range starts below the last row
+ */
+int clip_ranges(job *jb)
+{
+    unsigned int height = jb->geo.bands * jb->geo.band_height;
+    for (int i = 0; i < jb->ranges; i++)
+    {
+        if (jb->rows[i].first >= height)
+        {
+            return -1;
+        }
+        jb->rows[i].last = min(jb->rows[i].last, height - 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief  parse "N output [WIDTHxBAND_HEIGHTxBANDS] [rows=RANGES]" into a job
+ * @return 0 on success, -1 on a malformed line or a geometry that doesn't
+ *         fit in canvas_bytes
+ */
+int parse_job(const char *line, job *jb, unsigned long canvas_bytes)
+{
+    char words[3][128];
+    int used = 0;
+    jb->geo = default_geometry;
+    jb->ranges = 0;
+    jb->out_fd = -1;
+    jb->reply_fd = -1;
+    if (sscanf(line, "%d %255s%n", &jb->image, jb->output, &used) != 2)
+    {
+        return -1;
+    }
+    // then the geometry and the rows, in either order
+    int n = sscanf(line + used, "%127s %127s %127s", words[0], words[1], words[2]);
+    if (n > 2)
+    {
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (strncmp(words[i], "rows=", 5) == 0 ? parse_ranges(words[i] + 5, jb) != 0
+                                              : sscanf(words[i], "%ux%ux%u", &jb->geo.width, &jb->geo.band_height, &jb->geo.bands) != 3)
+        {
+            return -1;
+        }
+    }
+    if (jb->geo.width == 0 || jb->geo.band_height == 0 || jb->geo.bands == 0 || jb->geo.bands > MAX_BANDS ||
+        CANVAS_BYTES(&jb->geo) > canvas_bytes || clip_ranges(jb) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  read a batch file, one "N output [WxHxBANDS] [rows=RANGES]" job per line. Blank
+ *         lines and lines starting with # are skipped.
+ * @return number of jobs, stored in a malloc'd array at *jobs, -1 on error
+ */
+int read_jobs(const char *path, job **jobs, unsigned long canvas_bytes)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[512];
+    int count = 0;
+    int cap = 16;
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    *jobs = malloc(cap * sizeof(job));
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        job jb;
+        char *p = line + strspn(line, " \t");
+        if (*p == '\n' || *p == '\0' || *p == '#')
+        {
+            continue;
+        }
+        if (parse_job(p, &jb, canvas_bytes) != 0)
+        {
+            fprintf(stderr, "%s: bad job line: %s", path, line);
+            free(*jobs);
+            if (fp != stdin)
+            {
+                fclose(fp);
+            }
+            return -1;
+        }
+        if (count == cap)
+        {
+            cap *= 2;
+            *jobs = realloc(*jobs, cap * sizeof(job));
+        }
+        (*jobs)[count++] = jb;
+    }
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+    return count;
+}
+
+/**
+ * @brief  listen on a Unix domain socket at path, replacing a stale socket
+ * @return listening descriptor, -1 on error
+ */
+int daemon_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief  take a new daemon connection. It is not blocking, its request is
+ *         read by daemon_read as it comes in, so a slow client holds up
+ *         neither the other clients nor the jobs being written out.
+ */
+void daemon_accept(int listen_fd, daemon_client *clients)
+{
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (conn < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            perror("accept");
+        }
+        return;
+    }
+    for (int i = 0; i < DAEMON_CLIENTS; i++)
+    {
+        if (clients[i].fd < 0)
+        {
+            clients[i].fd = conn;
+            clients[i].passed_fd = -1;
+            clients[i].len = 0;
+            clients[i].since = now();
+            return;
+        }
+    }
+    job jb = {.reply_fd = conn};
+    reply_job(&jb, "error busy, %d requests are coming in already\n", DAEMON_CLIENTS);
+}
+
+/**
+ * @brief  hang up on a daemon client whose request is not coming or not
+ *         wanted, answering it with why unless why is NULL
+ */
+void daemon_drop(daemon_client *cl, const char *why)
+{
+    job jb = {.reply_fd = cl->fd};
+    if (why != NULL)
+    {
+        reply_job(&jb, "error %s\n", why);
+    }
+    else
+    {
+        close(cl->fd);
+    }
+    if (cl->passed_fd >= 0)
+    {
+        close(cl->passed_fd);
+    }
+    cl->fd = -1;
+}
+
+/**
+ * @brief  read what a daemon client sent since last time. The request is a
+ *         single job line, up to a '\n' or the client shutting down its side,
+ *         that may come in pieces; the output file descriptor (SCM_RIGHTS),
+ *         when the output is "fd", may come with any of them.
+ * @return 0 with the job filled in, 1 while the line is incomplete, -1 if the
+ *         client left or was refused (it has been answered and the entry is
+ *         free again)
+ */
+int daemon_read(daemon_client *cl, job *jb, unsigned long canvas_bytes)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {cl->line + cl->len, sizeof(cl->line) - 1 - cl->len};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t n = recvmsg(cl->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return 1;
+    }
+    struct cmsghdr *cmsg = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if (cl->passed_fd >= 0)
+        {
+            close(fd); // the first one sent is the output
+        }
+        else
+        {
+            cl->passed_fd = fd;
+        }
+    }
+    if (n < 0 || (n == 0 && cl->len == 0))
+    {
+        daemon_drop(cl, NULL);
+        return -1;
+    }
+    cl->len += n;
+    cl->line[cl->len] = '\0';
+    char *end = strchr(cl->line + cl->len - n, '\n');
+    if (end != NULL)
+    {
+        *end = '\0';
+    }
+    else if (n > 0 && cl->len == sizeof(cl->line) - 1)
+    {
+        daemon_drop(cl, "request line too long");
+        return -1;
+    }
+    else if (n > 0)
+    {
+        return 1;
+    }
+
+    if (parse_job(cl->line, jb, canvas_bytes) != 0)
+    {
+        char why[128];
+        snprintf(why, sizeof(why), "bad request (want: N output [WIDTHxBAND_HEIGHTxBANDS] [rows=RANGES], up to %lu canvas bytes)",
+                 canvas_bytes);
+        daemon_drop(cl, why);
+        return -1;
+    }
+    if (strcmp(jb->output, "fd") == 0 && cl->passed_fd < 0)
+    {
+        daemon_drop(cl, "output \"fd\" but no descriptor was sent");
+        return -1;
+    }
+    if (strcmp(jb->output, "fd") == 0)
+    {
+        jb->out_fd = cl->passed_fd;
+    }
+    else if (cl->passed_fd >= 0)
+    {
+        close(cl->passed_fd);
+    }
+    // the answer is written in one go once the job is done
+    fcntl(cl->fd, F_SETFL, fcntl(cl->fd, F_GETFL) & ~O_NONBLOCK);
+    jb->reply_fd = cl->fd;
+    cl->fd = -1;
+    return 0;
+}
+
+static volatile sig_atomic_t stop_daemon = 0;
+
+void on_stop_signal(int sig)
+{
+    stop_daemon = 1;
+}
+
+/**
+ * @brief  one line of a group of workers' buffer allocations
+ */
+void print_arena_stats(const char *who, arena_stats *st)
+{
+    fprintf(stderr, "%s: %lu buffers allocated, %lu of them reused, %lu freed, %lu mappings of %.1f MiB in total, "
+                    "at most %.1f KiB in use in one worker\n",
+            who, st->allocs, st->reused, st->frees, st->maps, st->mapped / 1048576.0, st->peak / 1024.0);
+}
+
+// what the metrics thread reads, all of it in shared memory and none of it under the lock
+typedef struct metrics_view
+{
+    shared *shared_mem;
+    ringq *ring;
+    double started;
+} metrics_view;
+
+#define PEEK(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+void metric_head(metrics_buf *out, const char *name, const char *type, const char *help)
+{
+    metrics_printf(out, "# HELP paster2_%s %s\n# TYPE paster2_%s %s\n", name, help, name, type);
+}
+
+void metric(metrics_buf *out, const char *name, const char *type, const char *help, double v)
+{
+    metric_head(out, name, type, help);
+    metrics_printf(out, "paster2_%s %.15g\n", name, v);
+}
+
+/**
+ * @brief  the pipeline's state in the Prometheus text format
+ */
+void expose_metrics(metrics_buf *out, void *arg)
+{
+    metrics_view *mv = arg;
+    shared *sh = mv->shared_mem;
+    int active = 0;
+    for (int i = 0; i < sh->slots; i++)
+    {
+        active += PEEK(sh->canvases[i].active);
+    }
+
+    metric(out, "uptime_seconds", "gauge", "Seconds since the workers started.", now() - mv->started);
+    metric(out, "ring_records", "gauge", "Fragments queued on the ring.", PEEK(mv->ring->count));
+    metric(out, "ring_capacity_records", "gauge", "Fragments the ring holds.", mv->ring->slots);
+    metric(out, "ring_bytes", "gauge", "Bytes of the ring in use.", PEEK(mv->ring->bytes_used));
+    metric(out, "ring_capacity_bytes", "gauge", "Bytes the ring holds.", mv->ring->byte_budget);
+    metric(out, "fragments_delayed", "gauge", "Fragments taken off the ring and waiting out the consumer delay.",
+           PEEK(sh->fragments_delayed));
+    metric(out, "fragments_posted_total", "counter", "Fragments of every job posted.", PEEK(sh->total_fragments));
+    metric(out, "fragments_fetch_claimed_total", "counter", "Fragments claimed by producers.", PEEK(sh->images_downloaded));
+    metric(out, "fragments_consume_claimed_total", "counter", "Fragments claimed by consumers.", PEEK(sh->images_processed));
+    metric(out, "fragments_stitched_total", "counter", "Fragments inflated into a canvas.", PEEK(sh->fragments_stitched));
+    metric(out, "fragments_dropped_total", "counter", "Fragments that arrived but could not be used.",
+           PEEK(sh->fragments_dropped));
+    metric(out, "fragments_given_up_total", "counter", "Fragments the producers gave up on.", PEEK(sh->fragments_lost));
+    metric(out, "retries_total", "counter", "Requests retried.", PEEK(sh->budget.retries));
+    metric(out, "rate_limit_waits_total", "counter", "Requests held back by the rate limits.", PEEK(sh->limit_waits));
+    metric(out, "rate_limit_wait_seconds_total", "counter", "Time requests were held back by the rate limits.",
+           PEEK(sh->limit_wait_ns) / 1e9);
+    metric(out, "canvas_resident_bytes", "gauge", "Bytes of file backed canvases in memory.", PEEK(sh->resident));
+    metric(out, "canvas_spilled_bytes_total", "counter", "Bytes of file backed canvases written back early.",
+           PEEK(sh->spilled));
+    metric(out, "jobs_active", "gauge", "Images being stitched.", active);
+    metric(out, "jobs_completed_total", "counter", "Images written.", PEEK(sh->jobs_done));
+    metric(out, "jobs_failed_total", "counter", "Images incomplete or not written.", PEEK(sh->jobs_failed));
+
+    metric_head(out, "requests_inflight", "gauge", "Fragment requests running.");
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        metrics_printf(out, "paster2_requests_inflight{backend=\"" HOST_NAME "\"} %ld\n", h + 1,
+                       PEEK(sh->host_stats[h].inflight));
+    }
+    metric_head(out, "requests_total", "counter", "Fragment requests finished, failed or not.");
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        metrics_printf(out, "paster2_requests_total{backend=\"" HOST_NAME "\"} %ld\n", h + 1,
+                       PEEK(sh->host_stats[h].requests));
+    }
+    metric_head(out, "request_failures_total", "counter", "Fragment requests that failed.");
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        metrics_printf(out, "paster2_request_failures_total{backend=\"" HOST_NAME "\"} %ld\n", h + 1,
+                       PEEK(sh->host_stats[h].failures));
+    }
+    metric_head(out, "breaker_state", "gauge", "Circuit breaker of a backend: 0 closed, 1 open, 2 half open.");
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        metrics_printf(out, "paster2_breaker_state{backend=\"" HOST_NAME "\"} %d\n", h + 1, PEEK(sh->breakers[h].state));
+    }
+    metric_head(out, "request_duration_seconds", "histogram", "Time fragment requests took.");
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        host_stats *hs = sh->host_stats + h;
+        long seen = 0;
+        for (int b = 0; b <= LATENCY_BUCKETS; b++)
+        {
+            seen += PEEK(hs->latency[b]);
+            if (b < LATENCY_BUCKETS)
+            {
+                metrics_printf(out, "paster2_request_duration_seconds_bucket{backend=\"" HOST_NAME "\",le=\"%g\"} %ld\n",
+                               h + 1, latency_bounds_us[b] / 1e6, seen);
+            }
+            else
+            {
+                metrics_printf(out, "paster2_request_duration_seconds_bucket{backend=\"" HOST_NAME "\",le=\"+Inf\"} %ld\n",
+                               h + 1, seen);
+            }
+        }
+        metrics_printf(out, "paster2_request_duration_seconds_sum{backend=\"" HOST_NAME "\"} %.6f\n", h + 1,
+                       PEEK(hs->latency_us) / 1e6);
+        metrics_printf(out, "paster2_request_duration_seconds_count{backend=\"" HOST_NAME "\"} %ld\n", h + 1, seen);
+    }
+}
+
+/**
+ * @brief  one line of the pipeline's state for stderr
+ */
+void summarize_metrics(metrics_buf *out, void *arg)
+{
+    metrics_view *mv = arg;
+    shared *sh = mv->shared_mem;
+    long inflight = 0;
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        inflight += PEEK(sh->host_stats[h].inflight);
+    }
+    metrics_printf(out, "[%.1fs] fragments %ld/%d stitched, %ld given up, ring %d/%d, %ld requests in flight, %ld delayed, "
+                        "mean latency",
+                   now() - mv->started, PEEK(sh->fragments_stitched), PEEK(sh->total_fragments), PEEK(sh->fragments_lost),
+                   PEEK(mv->ring->count), mv->ring->slots, inflight, PEEK(sh->fragments_delayed));
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        long n = PEEK(sh->host_stats[h].requests);
+        metrics_printf(out, " %.1f", n > 0 ? PEEK(sh->host_stats[h].latency_us) / 1e3 / n : 0.0);
+    }
+    metrics_printf(out, " ms\n");
+}
+
+/**
+ * @brief  what every stage counted with -e cost, one line per stage
+ */
+void print_stages(shared *shared_mem)
+{
+    fprintf(stderr, "%-9s %8s %10s", "stage", "runs", "seconds");
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        fprintf(stderr, " %14s", perf_event_name(e));
+    }
+    fprintf(stderr, " %6s\n", "IPC");
+    for (int i = 0; i < STAGES; i++)
+    {
+        perf_total *t = shared_mem->stages + i;
+        fprintf(stderr, "%-9s %8lu %10.6f", stage_names[i], (unsigned long)t->count, t->ns / 1e9);
+        for (int e = 0; e < PERF_EVENTS; e++)
+        {
+            if (t->have & (1U << e))
+            {
+                fprintf(stderr, " %14lu", (unsigned long)t->v[e]);
+            }
+            else
+            {
+                fprintf(stderr, " %14s", "-");
+            }
+        }
+        if (t->v[PERF_CYCLES] > 0)
+        {
+            fprintf(stderr, " %6.2f", (double)t->v[PERF_INSTRUCTIONS] / t->v[PERF_CYCLES]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+/**
+ * @brief  parse a "global[/per_server]" rate limit, either part may be 0 for none
+ */
+void parse_limit(const char *arg, double limit[2])
+{
+    char *end;
+    limit[0] = strtod(arg, &end);
+    limit[1] = *end == '/' ? strtod(end + 1, NULL) : 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i idat_chunk_bytes] [-b ring_bytes] [-H] [-A] [-k claim_batch] [-s spins] [-w inflight] [-2] [-T timeout_ms] [-R attempts] [-D refresh_s] [-r rps[/per_server]] [-l bytes_per_s[/per_server]] [-v] [-e] [-m metrics_addr] [-M summary_s] [-F canvas_dir] [-L mem_ceiling] [-p levels] [-o output|-] [-y rows] [-S] B P C X N\n", prog);
+    fprintf(stderr, "       %s [-i idat_chunk_bytes] [-b ring_bytes] [-H] [-A] [-k claim_batch] [-s spins] [-w inflight] [-2] [-T timeout_ms] [-R attempts] [-D refresh_s] [-r rps[/per_server]] [-l bytes_per_s[/per_server]] [-v] [-e] [-m metrics_addr] [-M summary_s] [-F canvas_dir] [-L mem_ceiling] [-p levels] [-S] [-c canvases] [-C canvas_bytes] -j jobs_file B P C X\n", prog);
+    fprintf(stderr, "       %s [-i idat_chunk_bytes] [-b ring_bytes] [-H] [-A] [-k claim_batch] [-s spins] [-w inflight] [-2] [-T timeout_ms] [-R attempts] [-D refresh_s] [-r rps[/per_server]] [-l bytes_per_s[/per_server]] [-v] [-e] [-m metrics_addr] [-M summary_s] [-F canvas_dir] [-L mem_ceiling] [-p levels] [-S] [-c canvases] [-C canvas_bytes] -d socket_path B P C X\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long idat_chunk = 0; // max bytes per IDAT chunk in all.png, 0 = single chunk
+    const char *output = "all.png"; // "-" is stdout
+    int streaming = 0;              // write IDAT as bands complete instead of at the end
+    const char *jobs_file = NULL;   // batch mode, "N output" per line
+    const char *socket_path = NULL; // daemon mode, requests come in on this socket
+    int slots = 2;                  // canvases in batch and daemon mode, jobs stitched at once
+    unsigned long canvas_bytes = CANVAS_BYTES(&default_geometry);
+    size_t byte_budget = 0;         // bytes of fragment data the ring holds, 0 = 10000 per slot
+    int seg_flags = 0;              // SHM_SEG_HUGE for the canvas and ring segments
+    const char *canvas_dir = NULL;  // map the canvases from a file here instead of memory
+    unsigned long mem_ceiling = 0;  // canvas bytes kept in memory with a file, 0 = no limit
+    int placed = 0;                 // pin workers to CPUs and put memory on their nodes
+    int claim_batch = 1;            // fragments a worker claims at once
+    int spin = 200;                 // polls of the ring before a worker sleeps on it
+    int inflight = 1;               // fragments a consumer delays at once
+    int http2 = 0;                  // multiplex fragment requests over h2c
+    long request_timeout = 10000;   // ms a fragment request may take
+    int max_attempts = 5;           // tries per fragment
+    long dns_refresh = 60;          // s between lookups of the backends, 0 = at startup only
+    double rps[2] = {0, 0};         // requests/s over every backend and to each, 0 = no limit
+    double bps[2] = {0, 0};         // bytes/s the same way
+    int verbose = 0;                // worker statistics on stderr at exit
+    int perf = 0;                   // count every stage with perf_event_open
+    const char *metrics_addr = NULL; // serve live metrics here, a Unix socket path or [host:]port
+    double summary_s = 0;           // seconds between summaries on stderr, 0 = none
+    const char *rows = NULL;        // ranges of rows to stitch, NULL = all of them
+    int pyramid_levels = 0;         // 2x, 4x ... copies written next to each output
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:Sj:c:d:C:b:HAk:s:w:2T:R:D:r:l:vy:p:em:M:F:L:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            idat_chunk = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'S':
+            streaming = 1;
+            break;
+        case 'j':
+            jobs_file = optarg;
+            break;
+        case 'c':
+            slots = atoi(optarg);
+            break;
+        case 'd':
+            socket_path = optarg;
+            break;
+        case 'C':
+            canvas_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            byte_budget = strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            seg_flags |= SHM_SEG_HUGE;
+            break;
+        case 'A':
+            placed = 1;
+            break;
+        case 'k':
+            claim_batch = atoi(optarg);
+            break;
+        case 's':
+            spin = atoi(optarg);
+            break;
+        case 'w':
+            inflight = atoi(optarg);
+            break;
+        case '2':
+            http2 = 1;
+            break;
+        case 'T':
+            request_timeout = atol(optarg);
+            break;
+        case 'R':
+            max_attempts = atoi(optarg);
+            break;
+        case 'D':
+            dns_refresh = atol(optarg);
+            break;
+        case 'r':
+            parse_limit(optarg, rps);
+            break;
+        case 'l':
+            parse_limit(optarg, bps);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'e':
+            perf = 1;
+            break;
+        case 'm':
+            metrics_addr = optarg;
+            break;
+        case 'M':
+            summary_s = atof(optarg);
+            break;
+        case 'F':
+            canvas_dir = optarg;
+            break;
+        case 'L':
+            mem_ceiling = strtoul(optarg, NULL, 10);
+            break;
+        case 'y':
+            rows = optarg;
+            break;
+        case 'p':
+            pyramid_levels = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    int single = jobs_file == NULL && socket_path == NULL;
+    if (argc - optind < (single ? 5 : 4) || slots < 1 || claim_batch < 1 || inflight < 1 || request_timeout < 1 || max_attempts < 1 || dns_refresh < 0 || pyramid_levels < 0 || pyramid_levels > PYR_MAX_LEVELS || (jobs_file != NULL && socket_path != NULL))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    argv += optind;
+    int B = atoi(argv[0]); // buffer size
+    int P = atoi(argv[1]); // producers
+    int C = atoi(argv[2]); // consumers
+    int X = atoi(argv[3]); // consumer sleep time
+    if (byte_budget == 0)
+    {
+        byte_budget = (size_t)B * 10000; // what the fixed 10000 byte slots used to hold
+    }
+
+    // jobs waiting for a canvas, in order
+    job *queue = NULL;
+    int queued = 0;
+    int queue_head = 0;
+    int queue_cap = 0;
+    if (jobs_file != NULL)
+    {
+        queued = read_jobs(jobs_file, &queue, canvas_bytes);
+        if (queued <= 0)
+        {
+            fprintf(stderr, "%s: no jobs\n", jobs_file);
+            return 1;
+        }
+        queue_cap = queued;
+        if (slots > queued)
+        {
+            slots = queued;
+        }
+    }
+    else if (single)
+    {
+        queue_cap = queued = 1;
+        queue = malloc(sizeof(job));
+        queue->image = atoi(argv[4]); // image #
+        queue->geo = default_geometry;
+        queue->ranges = 0;
+        queue->out_fd = -1;
+        queue->reply_fd = -1;
+        snprintf(queue->output, sizeof(queue->output), "%s", output);
+        if (rows != NULL && (parse_ranges(rows, queue) != 0 || clip_ranges(queue) != 0))
+        {
+            fprintf(stderr, "bad row ranges: %s\n", rows);
+            return 1;
+        }
+        slots = 1;
+    }
+
+    int listen_fd = -1;
+    if (socket_path != NULL)
+    {
+        listen_fd = daemon_listen(socket_path);
+        if (listen_fd < 0)
+        {
+            return 1;
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_stop_signal; // no SA_RESTART, so poll() returns
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN); // clients may hang up before their answer
+    }
+
+    pid_t cpids[P + C];
+    pid_t pid = 0;
+
+    // worker i runs on cpus[i % ncpus], producers first
+    int cpus[P + C > 0 ? P + C : 1];
+    int ncpus = placed ? cpu_list(cpus, P + C > 0 ? P + C : 1) : 0;
+
+    // control block and canvas headers, then the canvas pixels each starting on a page
+    // of their own so they can be placed on different nodes
+    size_t page = shm_seg_page(seg_flags);
+    size_t head_bytes = (sizeof(shared) + slots * sizeof(canvas) + page - 1) / page * page;
+    size_t canvas_stride = (canvas_bytes + page - 1) / page * page;
+    // out of core, the canvas pixels are a file of their own instead
+    int out_of_core = canvas_dir != NULL || mem_ceiling > 0;
+    shm_seg canvas_seg;
+    if (out_of_core && shm_seg_file(&canvas_seg, canvas_dir != NULL ? canvas_dir : P_tmpdir, slots * canvas_stride) != 0)
+    {
+        perror(canvas_dir != NULL ? canvas_dir : P_tmpdir);
+        return 1;
+    }
+    if (out_of_core && shm_seg_in_memory(&canvas_seg))
+    {
+        // writing bands back to a file in memory frees nothing
+        if (canvas_dir == NULL)
+        {
+            fprintf(stderr, "%s is in memory, give -L a directory on disk with -F\n", P_tmpdir);
+            shm_seg_destroy(&canvas_seg);
+            return 1;
+        }
+        fprintf(stderr, "warning: %s is in memory, the canvases kept out of core still take memory\n", canvas_dir);
+    }
+    shm_seg share_seg;
+    if (shm_seg_create(&share_seg, head_bytes + (out_of_core ? 0 : slots * canvas_stride), seg_flags) != 0)
+    {
+        perror("shmget");
+        abort();
+    }
+    void *share_at = share_seg.addr;
+    shared *share = (shared *)share_at;
+    unsigned char *pixels_at = out_of_core ? canvas_seg.addr : (unsigned char *)share_at + head_bytes;
+    memset(&share->canvas_seg, 0, sizeof(shm_seg));
+    share->canvas_seg.fd = -1;
+    if (out_of_core)
+    {
+        share->canvas_seg = canvas_seg;
+    }
+    share->mem_ceiling = mem_ceiling;
+    share->resident = 0;
+    share->spilled = 0;
+    share->images_downloaded = 0;
+    share->claim_turn = 0;
+    share->images_processed = 0;
+    share->total_fragments = 0;
+    share->closed = 0;
+    share->slots = slots;
+    share->canvas_bytes = canvas_bytes;
+    share->consumers_done = 0;
+    share->claim_batch = claim_batch;
+    share->inflight = inflight;
+    share->request_timeout = request_timeout;
+    share->max_attempts = max_attempts;
+    memset(&share->budget, 0, sizeof(share->budget));
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        share->host_proto[h] = http2 ? PROTO_H2C : PROTO_H1;
+        memset(share->breakers + h, 0, sizeof(breaker));
+    }
+    tbucket_init(&share->req_limit, rps[0], rps[0] * LIMIT_BURST);
+    tbucket_init(&share->byte_limit, bps[0], bps[0] * LIMIT_BURST);
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        tbucket_init(share->host_req_limit + h, rps[1], rps[1] * LIMIT_BURST);
+        tbucket_init(share->host_byte_limit + h, bps[1], bps[1] * LIMIT_BURST);
+    }
+    share->limit_waits = 0;
+    memset(&share->producer_mem, 0, sizeof(arena_stats));
+    memset(&share->consumer_mem, 0, sizeof(arena_stats));
+    share->limit_wait_ns = 0;
+    share->perf = perf;
+    memset(share->host_stats, 0, sizeof(share->host_stats));
+    share->fragments_stitched = share->fragments_dropped = share->fragments_lost = share->fragments_delayed = 0;
+    share->jobs_done = share->jobs_failed = 0;
+    memset(share->stages, 0, sizeof(share->stages));
+    // look the backends up once for every producer, instead of each producer on its own
+    resolver_init(&share->dns);
+    for (int h = 0; h < NUM_HOSTS; h++)
+    {
+        char host[64];
+        snprintf(host, sizeof(host), HOST_NAME, h + 1);
+        resolver_add(&share->dns, host, HOST_PORT);
+    }
+    resolver_refresh(&share->dns);
+    share->canvases = (canvas *)(share_at + sizeof(shared));
+    for (int i = 0; i < slots; i++)
+    {
+        share->canvases[i].active = 0;
+        share->canvases[i].claims = 0;
+        share->canvases[i].buffer = pixels_at + i * canvas_stride;
+        if (placed && C > 0 && !out_of_core)
+        {
+            // any consumer may write any canvas, spread them over the consumers' nodes
+            int node = cpu_node(cpus[(P + i % C) % ncpus]);
+            if (node < 64)
+            {
+                shm_seg_bind(&share_seg, head_bytes + i * canvas_stride, canvas_bytes, 1UL << node, 0);
+            }
+        }
+    }
+    if ((placed || seg_flags) && !out_of_core)
+    {
+        shm_seg_prefault(&share_seg, head_bytes, slots * canvas_stride);
+    }
+    share->band_efd = eventfd(0, EFD_CLOEXEC);
+    if (share->band_efd < 0)
+    {
+        perror("eventfd");
+        abort();
+    }
+
+    // CIRCLEQ_HEAD(ring_buffer, recv_chunk) head;
+    // need to track max and current size - struct?
+
+    // fragment queue: header, slot descriptors, then the byte ring
+    shm_seg ring_seg;
+    if (shm_seg_create(&ring_seg, ringq_size(B, byte_budget), seg_flags) != 0)
+    {
+        perror("shmget");
+        abort();
+    }
+    void *start_ring = ring_seg.addr;
+    if (placed)
+    {
+        // the producers write the ring, interleave it over their nodes
+        unsigned long nodes = 0;
+        for (int i = 0; i < P; i++)
+        {
+            int node = cpu_node(cpus[i % ncpus]);
+            if (node < 64)
+            {
+                nodes |= 1UL << node;
+            }
+        }
+        shm_seg_bind(&ring_seg, 0, ring_seg.size, nodes, 1);
+    }
+    if (placed || seg_flags)
+    {
+        shm_seg_prefault(&ring_seg, 0, ring_seg.size);
+    }
+
+    // initialize ring buffer
+    ringq *shared_ring = ringq_init(start_ring, B, byte_budget, spin);
+
+    // with an image on stdout the timing line goes to stderr
+    FILE *timing_out = socket_path != NULL ? stderr : stdout;
+    for (int i = 0; i < queued; i++)
+    {
+        if (strcmp(queue[i].output, "-") == 0)
+        {
+            timing_out = stderr;
+        }
+    }
+    int status = 0;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&share->lock, &attr);
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&share->job_posted, &cattr);
+
+    // set up curl once for every producer instead of on each curl_easy_init
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    double times[2];
+    times[0] = now();
+
+    for (int i = 0; i < P; i++)
+    {
+        // pid[i] = fork();
+        pid = fork();
+        if (pid > 0)
+        {
+            cpids[i] = pid;
+        }
+        else if (pid == 0)
+        {
+            if (placed)
+            {
+                pin_cpu(cpus[i % ncpus]);
+            }
+            producer(share, shared_ring);
+            // shmdt(share_at);
+            // shmdt(start_ring);
+            exit(0);
+        }
+        else
+        {
+            perror("fork");
+            abort();
+        }
+    }
+
+    // consumers:
+    for (int i = P; i < P + C; i++)
+    {
+        pid = fork();
+        if (pid > 0)
+        {
+            cpids[i] = pid;
+        }
+        else if (pid == 0)
+        {
+            if (placed)
+            {
+                pin_cpu(cpus[i % ncpus]);
+            }
+            consumer(share, shared_ring, X);
+            // shmdt(share_at);
+            // shmdt(start_ring);
+            exit(0);
+        }
+        else
+        {
+            perror("fork");
+            abort();
+        }
+    }
+
+    int state;
+
+    // keep the backend addresses fresh without any producer waiting on a lookup
+    resolver_refresher refresher;
+    int refreshing = pid > 0 && dns_refresh > 0 && resolver_start(&refresher, &share->dns, dns_refresh * 1000) == 0;
+
+    // live metrics, read from the shared segment by a thread of the parent
+    metrics_view view = {share, shared_ring, times[0]};
+    metrics_server exporter;
+    int exporting = 0;
+    if (pid > 0 && (metrics_addr != NULL || summary_s > 0))
+    {
+        int err = metrics_start(&exporter, metrics_addr, (long)(summary_s * 1000), expose_metrics, summarize_metrics, &view);
+        if (err != 0)
+        {
+            fprintf(stderr, "metrics %s: %s\n", metrics_addr != NULL ? metrics_addr : "", strerror(err));
+        }
+        exporting = err == 0;
+    }
+
+    // parent hands jobs to free canvases and writes them out as they complete
+    if (pid > 0)
+    {
+        // opened after the fork, so no worker starts out holding the parent's counters
+        if (perf && perf_open(&perf_self) == 0)
+        {
+            perror("perf_event_open");
+        }
+        slot_state *states = calloc(slots, sizeof(slot_state));
+        int busy = 0;
+        daemon_client clients[DAEMON_CLIENTS]; // requests still coming in
+        for (int i = 0; i < DAEMON_CLIENTS; i++)
+        {
+            clients[i].fd = -1;
+        }
+        while (1)
+        {
+            // start queued jobs while there are free canvases
+            for (int i = 0; i < slots && queue_head < queued; i++)
+            {
+                if (!states[i].busy)
+                {
+                    if (start_job(share, states + i, i, queue + queue_head++, streaming, idat_chunk, pyramid_levels) == 0)
+                    {
+                        busy++;
+                    }
+                    else
+                    {
+                        status = 1;
+                    }
+                }
+            }
+            if (listen_fd < 0 || stop_daemon)
+            {
+                if (listen_fd >= 0)
+                {
+                    close(listen_fd);
+                    unlink(socket_path);
+                    listen_fd = -1;
+                    for (int i = 0; i < DAEMON_CLIENTS; i++)
+                    {
+                        if (clients[i].fd >= 0)
+                        {
+                            daemon_drop(clients + i, "shutting down");
+                        }
+                    }
+                }
+                if (queue_head == queued && !share->closed)
+                {
+                    close_jobs(share);
+                }
+                if (busy == 0 && queue_head == queued)
+                {
+                    break;
+                }
+            }
+
+            // the eventfd, then the listening socket and the clients whose request is coming in
+            struct pollfd fds[2 + DAEMON_CLIENTS] = {{share->band_efd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+            daemon_client *polled[DAEMON_CLIENTS];
+            int nfds = listen_fd >= 0 ? 2 : 1;
+            int wait_ms = -1; // until the first client runs out of time
+            for (int i = 0; listen_fd >= 0 && i < DAEMON_CLIENTS; i++)
+            {
+                if (clients[i].fd >= 0)
+                {
+                    int left = (int)((clients[i].since - now()) * 1000) + DAEMON_READ_MS;
+                    wait_ms = wait_ms < 0 || left < wait_ms ? max(left, 0) : wait_ms;
+                    polled[nfds - 2] = clients + i;
+                    fds[nfds++] = (struct pollfd){clients[i].fd, POLLIN, 0};
+                }
+            }
+            if (poll(fds, nfds, wait_ms) < 0 && errno != EINTR)
+            {
+                perror("poll");
+                abort();
+            }
+            if (fds[0].revents & POLLIN)
+            {
+                uint64_t events;
+                if (read(share->band_efd, &events, sizeof(events)) < 0)
+                {
+                    perror("read eventfd");
+                }
+            }
+            for (int k = 2; k < nfds; k++)
+            {
+                job jb;
+                daemon_client *cl = polled[k - 2];
+                int got = fds[k].revents & (POLLIN | POLLHUP | POLLERR) ? daemon_read(cl, &jb, canvas_bytes) : 1;
+                if (got == 1 && now() - cl->since >= DAEMON_READ_MS / 1000.0)
+                {
+                    daemon_drop(cl, "request not received in time");
+                }
+                else if (got == 0)
+                {
+                    if (queued == queue_cap)
+                    {
+                        // drop the served prefix before growing
+                        memmove(queue, queue + queue_head, (queued - queue_head) * sizeof(job));
+                        queued -= queue_head;
+                        queue_head = 0;
+                        if (queued == queue_cap)
+                        {
+                            queue_cap = queue_cap ? queue_cap * 2 : 16;
+                            queue = realloc(queue, queue_cap * sizeof(job));
+                        }
+                    }
+                    queue[queued++] = jb;
+                }
+            }
+            if (listen_fd >= 0 && (fds[1].revents & POLLIN))
+            {
+                daemon_accept(listen_fd, clients);
+            }
+
+            // write out finished jobs; when every consumer is gone nothing more will land
+            int consumers_gone = __atomic_load_n(&share->consumers_done, __ATOMIC_ACQUIRE) == C;
+            for (int i = 0; i < slots; i++)
+            {
+                if (!states[i].busy)
+                {
+                    continue;
+                }
+                // read before looking at the bands, so every band settled by then is seen
+                int settled = __atomic_load_n(&share->canvases[i].bands_settled, __ATOMIC_ACQUIRE) ==
+                              share->canvases[i].fragments;
+                if (advance_job(share, states + i, i) || settled || consumers_gone)
+                {
+                    if (finish_job(share, states + i, i, idat_chunk) != 0)
+                    {
+                        status = 1;
+                    }
+                    busy--;
+                }
+            }
+            if (consumers_gone && busy == 0 && queue_head < queued)
+            {
+                fprintf(stderr, "all consumers exited, %d jobs not run\n", queued - queue_head);
+                status = 1;
+                break;
+            }
+        }
+        free(states);
+        free(queue);
+        if (exporting)
+        {
+            metrics_stop(&exporter);
+        }
+        if (refreshing)
+        {
+            resolver_stop(&refresher);
+        }
+
+        for (int i = 0; i < P; i++)
+        {
+            waitpid(cpids[i], &state, 0);
+        }
+
+        for (int i = P; i < P + C; i++)
+        {
+            waitpid(cpids[i], &state, 0);
+        }
+
+        times[1] = now();
+        fprintf(timing_out, "paster2 execution time: %.6lf seconds\n", times[1] - times[0]);
+        if (rps[0] > 0 || rps[1] > 0 || bps[0] > 0 || bps[1] > 0)
+        {
+            fprintf(stderr, "rate limits held back %ld requests for %.6lf seconds in total\n", share->limit_waits,
+                    share->limit_wait_ns / 1e9);
+        }
+        if (verbose)
+        {
+            fprintf(stderr, "scanlines: RGBA rows filtered and unfiltered with %s kernels (PNG_SCANLINE_ISA to override)\n",
+                    png_scanline_isa());
+            print_arena_stats("producers", &share->producer_mem);
+            print_arena_stats("consumers", &share->consumer_mem);
+            if (out_of_core)
+            {
+                fprintf(stderr, "canvas file: %.1f MiB written back early to stay under %.1f MiB\n",
+                        share->spilled / 1048576.0, mem_ceiling / 1048576.0);
+            }
+        }
+        if (perf)
+        {
+            perf_close(&perf_self);
+            print_stages(share);
+        }
+
+        curl_global_cleanup();
+        close(share->band_efd);
+        ringq_destroy(shared_ring);
+        pthread_condattr_destroy(&cattr);
+        pthread_cond_destroy(&share->job_posted);
+        pthread_mutexattr_destroy(&attr);
+        pthread_mutex_destroy(&share->lock);
+        if (out_of_core && shm_seg_destroy(&canvas_seg) != 0)
+        {
+            perror("munmap");
+            abort();
+        }
+        if (shm_seg_destroy(&share_seg) != 0)
+        {
+            perror("shmctl");
+            abort();
+        }
+        if (shm_seg_destroy(&ring_seg) != 0)
+        {
+            perror("shmctl");
+            abort();
+        }
+    }
+    return status;
+}
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "./cat_png_functions/crc.h"
+#include "./cat_png_functions/pnginfo.h"
+
+// files to check, shared by the checking threads
+typedef struct batch
+{
+    char **paths;
+    png_report *reports;
+    int count;
+    int next; // next file to take, atomic
+    int flags;
+} batch;
+
+/**
+ * @brief  take files off the batch and check them until none are left
+ */
+void *check_files(void *arg)
+{
+    batch *b = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+    {
+        png_validate_file(b->paths[i], b->flags, b->reports + i);
+    }
+    return NULL;
+}
+
+/**
+ * @brief  read one path per line
+ * @return number of paths, -1 on error
+ */
+int read_paths(FILE *in, char ***paths)
+{
+    int count = 0, cap = 0;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t n;
+    while ((n = getline(&line, &len, in)) > 0)
+    {
+        if (line[n - 1] == '\n')
+        {
+            line[--n] = '\0';
+        }
+        if (n == 0)
+        {
+            continue;
+        }
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            *paths = realloc(*paths, cap * sizeof(char *));
+        }
+        (*paths)[count++] = strdup(line);
+    }
+    free(line);
+    return ferror(in) ? -1 : count;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-z] [-t threads] [-q] file...|-\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int flags = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN); // files checked at once
+    int quiet = 0;                                // only print bad files
+    int opt;
+    while ((opt = getopt(argc, argv, "zt:q")) != -1)
+    {
+        switch (opt)
+        {
+        case 'z':
+            flags |= PNG_CHECK_INFLATE;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind == argc || threads < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    batch b = {argv + optind, NULL, argc - optind, 0, flags};
+    char **listed = NULL;
+    if (b.count == 1 && strcmp(b.paths[0], "-") == 0)
+    {
+        // a list too long for the command line comes on stdin
+        b.count = read_paths(stdin, &listed);
+        if (b.count < 0)
+        {
+            perror("stdin");
+            return 2;
+        }
+        b.paths = listed;
+    }
+    b.reports = malloc((b.count > 0 ? b.count : 1) * sizeof(png_report));
+    if (threads > b.count)
+    {
+        threads = b.count > 0 ? b.count : 1;
+    }
+
+    make_crc_table(); // before the threads look at it
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(tids + i, NULL, check_files, &b) != 0)
+        {
+            perror("pthread_create");
+            return 2;
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+
+    int bad = 0;
+    for (int i = 0; i < b.count; i++)
+    {
+        png_report *rep = b.reports + i;
+        if (rep->error == PNG_E_OPEN)
+        {
+            printf("%s: %s\n", b.paths[i], strerror(rep->sys_errno));
+        }
+        else if (rep->error != PNG_OK)
+        {
+            printf("%s: %s", b.paths[i], png_strerror(rep->error));
+            if (rep->chunk[0] != '\0')
+            {
+                printf(" in %s chunk", rep->chunk);
+            }
+            printf(" at offset %zu\n", rep->offset);
+        }
+        else if (!quiet)
+        {
+            printf("%s: OK %ux%u, %d chunks\n", b.paths[i], rep->width, rep->height, rep->chunks);
+        }
+        bad += rep->error != PNG_OK;
+    }
+
+    for (int i = 0; listed != NULL && i < b.count; i++)
+    {
+        free(listed[i]);
+    }
+    free(listed);
+    free(b.reports);
+    return bad > 0;
+}
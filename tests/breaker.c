@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../cat_png_functions/retry.h"
+#include "../cat_png_functions/ratelimit.h"
+
+#define HOSTS 3
+
+static int failed;
+
+#define CHECK(cond)                                                   \
+    do                                                                \
+    {                                                                 \
+        if (!(cond))                                                  \
+        {                                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1;                                               \
+        }                                                             \
+    } while (0)
+
+/**
+ * @brief  every backend's breaker open and past its cooldown, the way
+ *         fetch_start finds them after they all failed a while ago
+ */
+static void open_all(breaker *brs, uint64_t now)
+{
+    memset(brs, 0, HOSTS * sizeof(breaker));
+    for (int h = 0; h < HOSTS; h++)
+    {
+        for (int i = 0; i < BREAKER_FAILURES; i++)
+        {
+            breaker_result(brs + h, 0, now - BREAKER_COOLDOWN);
+        }
+        CHECK(brs[h].state == BREAKER_OPEN);
+    }
+}
+
+/**
+ * @brief  a fetch takes a half open breaker's trial, then has to wait for
+ *         the rate limit; when it comes back it must still send the trial
+ */
+static void trial_through_limiter_wait(void)
+{
+    breaker brs[HOSTS];
+    tbucket limit;
+    uint64_t now = 10 * BREAKER_COOLDOWN;
+    uint64_t now_ns = tbucket_clock_ns();
+    open_all(brs, now);
+    tbucket_init(&limit, 1, 1);
+    tbucket_reserve(&limit, 1, now_ns); // the burst is spent
+
+    int host = breaker_pick(brs, HOSTS, 1, -1, now);
+    CHECK(host == 1);
+    CHECK(brs[1].state == BREAKER_HALF_OPEN);
+    CHECK(tbucket_reserve(&limit, 1, now_ns) > 0); // parks in FETCH_WAITING
+    int admitted = host;
+
+    // nobody else gets a trial of that backend in the meantime
+    CHECK(breaker_pick(brs, HOSTS, 1, -1, now) == 2);
+    CHECK(breaker_pick(brs, HOSTS, 1, -1, now) == 0);
+    CHECK(breaker_pick(brs, HOSTS, 1, -1, now) == -1);
+
+    // back from the wait, the trial goes out and its result closes the breaker
+    CHECK(breaker_pick(brs, HOSTS, 1, admitted, now + 1000) == 1);
+    breaker_result(brs + 1, 1, now + 1000);
+    CHECK(brs[1].state == BREAKER_CLOSED);
+    CHECK(breaker_pick(brs, HOSTS, 1, -1, now + 1000) == 1);
+}
+
+/**
+ * @brief  a failed trial opens the breaker again for another cooldown
+ */
+static void failed_trial_reopens(void)
+{
+    breaker brs[HOSTS];
+    uint64_t now = 10 * BREAKER_COOLDOWN;
+    open_all(brs, now);
+
+    CHECK(breaker_pick(brs, HOSTS, 0, -1, now) == 0);
+    breaker_result(brs + 0, 0, now);
+    CHECK(brs[0].state == BREAKER_OPEN);
+    CHECK(breaker_pick(brs, HOSTS, 0, -1, now + BREAKER_COOLDOWN - 1) == 1);
+    CHECK(breaker_pick(brs, HOSTS, 0, -1, now + BREAKER_COOLDOWN) == 0);
+}
+
+int main(void)
+{
+    trial_through_limiter_wait();
+    failed_trial_reopens();
+    printf("breaker: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
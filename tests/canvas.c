@@ -0,0 +1,141 @@
+// paster2's parent side, built in: its main is renamed out of the way
+#define main paster2_main
+#include "../paster2.c"
+#undef main
+
+static int failed;
+
+#define CHECK(cond)                                                   \
+    do                                                                \
+    {                                                                 \
+        if (!(cond))                                                  \
+        {                                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1;                                               \
+        }                                                             \
+    } while (0)
+
+#define STALE 0xab // what an earlier job left in the canvas
+#define PIXEL 0x11 // what the bands that came in hold
+
+static const geometry test_geometry = {8, 3, 4};
+
+/**
+ * @brief  read a PNG written by paster2 back into its unfiltered rows
+ * @return rows bytes, NULL on error
+ */
+static unsigned char *read_rows(const char *path, geometry *geo, unsigned int *height)
+{
+    FILE *f = fopen(path, "rb");
+    static unsigned char file[1 << 16];
+    unsigned char idat[sizeof(file)];
+    size_t len = f != NULL ? fread(file, 1, sizeof(file), f) : 0;
+    size_t idat_len = 0;
+    if (f != NULL)
+    {
+        fclose(f);
+    }
+    if (len < 8 + 25)
+    {
+        return NULL;
+    }
+    *height = ntohl(*(uint32_t *)(file + 8 + 8 + 4));
+    for (size_t at = 8; at + 12 <= len;)
+    {
+        uint32_t n = ntohl(*(uint32_t *)(file + at));
+        if (memcmp(file + at + 4, "IDAT", 4) == 0)
+        {
+            memcpy(idat + idat_len, file + at + 8, n);
+            idat_len += n;
+        }
+        at += 12 + n;
+    }
+
+    U64 rows_len = *height * ROW_BYTES(geo);
+    unsigned char *rows = malloc(rows_len);
+    if (mem_inf(rows, &rows_len, idat, idat_len) != Z_OK || rows_len != *height * ROW_BYTES(geo) ||
+        png_unfilter_rows(rows, *height, ROW_BYTES(geo) - 1, 4) != 0)
+    {
+        free(rows);
+        return NULL;
+    }
+    return rows;
+}
+
+/**
+ * @brief  a job whose band missing never arrives, in a canvas an earlier job
+ *         filled: the job fails and the output holds transparent rows for
+ *         that band, the others as they came in, streamed or not
+ */
+static void missing_band_transparent(int streaming, int missing)
+{
+    const char *path = "tests/canvas.png";
+    shared *shared_mem = calloc(1, sizeof(shared));
+    slot_state st;
+    job jb = {.geo = test_geometry, .out_fd = -1, .reply_fd = -1};
+    geometry *geo = &jb.geo;
+    strcpy(jb.output, path);
+    pthread_mutex_init(&shared_mem->lock, NULL);
+    shared_mem->slots = 1;
+    shared_mem->canvas_bytes = CANVAS_BYTES(geo);
+    shared_mem->canvas_seg.fd = -1;
+    shared_mem->canvases = calloc(1, sizeof(canvas));
+    canvas *cv = shared_mem->canvases;
+    cv->buffer = malloc(CANVAS_BYTES(geo));
+    memset(cv->buffer, STALE, CANVAS_BYTES(geo));
+
+    CHECK(start_job(shared_mem, &st, 0, &jb, streaming, 8192, 0) == 0);
+    for (unsigned int b = 0; b < geo->bands; b++)
+    {
+        if ((int)b == missing)
+        {
+            continue;
+        }
+        // unfiltered rows, filter byte 0 and the pixels, as process_fragment leaves them
+        for (unsigned int r = 0; r < geo->band_height; r++)
+        {
+            unsigned char *row = cv->buffer + BAND_BYTES(geo) * b + ROW_BYTES(geo) * r;
+            row[0] = 0;
+            memset(row + 1, PIXEL, ROW_BYTES(geo) - 1);
+        }
+        cv->band_done[b] = 1;
+        advance_job(shared_mem, &st, 0);
+    }
+    CHECK(finish_job(shared_mem, &st, 0, 8192) == 1);
+    CHECK(shared_mem->jobs_failed == 1);
+
+    unsigned int height = 0;
+    unsigned char *rows = read_rows(path, geo, &height);
+    CHECK(rows != NULL);
+    CHECK(height == geo->bands * geo->band_height);
+    for (unsigned int y = 0; rows != NULL && y < height; y++)
+    {
+        unsigned char want = (int)(y / geo->band_height) == missing ? 0 : PIXEL;
+        for (unsigned long x = 1; x < ROW_BYTES(geo); x++)
+        {
+            if (rows[ROW_BYTES(geo) * y + x] != want)
+            {
+                fprintf(stderr, "%s, band %d missing: row %u byte %lu is %#x, not %#x\n",
+                        streaming ? "streamed" : "written at the end", missing, y, x, rows[ROW_BYTES(geo) * y + x], want);
+                failed = 1;
+                break;
+            }
+        }
+    }
+    free(rows);
+    unlink(path);
+    free(cv->buffer);
+    free(shared_mem->canvases);
+    free(shared_mem);
+}
+
+int main(void)
+{
+    for (int streaming = 0; streaming <= 1; streaming++)
+    {
+        missing_band_transparent(streaming, 0);
+        missing_band_transparent(streaming, 2);
+    }
+    printf("canvas: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
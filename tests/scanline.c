@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// the kernel tables are static, built in to get at every one of them
+#include "../cat_png_functions/scanline.c"
+
+static int failed;
+
+#define CHECK(cond)                                                   \
+    do                                                                \
+    {                                                                 \
+        if (!(cond))                                                  \
+        {                                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1;                                               \
+        }                                                             \
+    } while (0)
+
+#define ROWS 4
+
+// pixels per row, around the 4 and 8 pixel SIMD steps and their tails
+static const unsigned int widths[] = {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 400};
+#define WIDTHS (sizeof(widths) / sizeof(widths[0]))
+
+static void fill(U8 *p, U64 n, unsigned int *seed)
+{
+    for (U64 i = 0; i < n; i++)
+    {
+        p[i] = rand_r(seed);
+    }
+}
+
+/**
+ * @brief  every filter of an RGBA kernel table against the scalar one: the
+ *         same filtered bytes, the same cost, and unfiltering gives back the
+ *         row, above a random row and above the zero row of an image's top
+ */
+static void simd_matches_scalar(const struct scanline_kernels *k)
+{
+    unsigned int seed = 252;
+    for (unsigned int w = 0; w < WIDTHS; w++)
+    {
+        U64 n = widths[w] * 4;
+        U8 *row = malloc(n), *prev = malloc(n), *zero = calloc(1, n);
+        U8 *want = malloc(n), *got = malloc(n);
+        fill(row, n, &seed);
+        fill(prev, n, &seed);
+        for (int top = 0; top <= 1; top++)
+        {
+            U8 *above = top ? zero : prev;
+            for (int f = PNG_FILTER_SUB; f <= PNG_FILTER_PAETH; f++)
+            {
+                scalar_kernels.filter[f](want, row, above, n, 4);
+                k->filter[f](got, row, above, n, 4);
+                if (memcmp(want, got, n) != 0 || scalar_kernels.cost(want, n) != k->cost(got, n))
+                {
+                    fprintf(stderr, "%s: filter %d of %u pixels differs from scalar\n", k->isa, f, widths[w]);
+                    failed = 1;
+                }
+                k->unfilter[f](got, above, n, 4);
+                if (memcmp(row, got, n) != 0)
+                {
+                    fprintf(stderr, "%s: unfilter %d of %u pixels doesn't give the row back\n", k->isa, f, widths[w]);
+                    failed = 1;
+                }
+            }
+        }
+        free(row);
+        free(prev);
+        free(zero);
+        free(want);
+        free(got);
+    }
+}
+
+/**
+ * @brief  png_filter_rows then png_unfilter_rows give the image back, for
+ *         every filter type and each pixel size the kernels are built for
+ */
+static void round_trip(int bpp)
+{
+    unsigned int seed = bpp;
+    for (unsigned int w = 0; w < WIDTHS; w++)
+    {
+        U64 rowbytes = widths[w] * bpp;
+        U64 stride = rowbytes + 1;
+        U8 *scan = malloc(ROWS * stride), *dest = malloc(ROWS * stride);
+        fill(scan, ROWS * stride, &seed);
+        for (int type = PNG_FILTER_NONE; type <= PNG_FILTER_ADAPTIVE; type++)
+        {
+            CHECK(png_filter_rows(dest, scan, NULL, ROWS, rowbytes, bpp, type) == 0);
+            CHECK(png_unfilter_rows(dest, ROWS, rowbytes, bpp) == 0);
+            for (unsigned int r = 0; r < ROWS; r++)
+            {
+                if (memcmp(scan + r * stride + 1, dest + r * stride + 1, rowbytes) != 0)
+                {
+                    fprintf(stderr, "%d bytes per pixel, filter %d, %u pixels: row %u not given back\n", bpp, type,
+                            widths[w], r);
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        free(scan);
+        free(dest);
+    }
+}
+
+int main(void)
+{
+    char tested[64] = "";
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        simd_matches_scalar(&sse4_kernels);
+        strcat(tested, " sse4.1");
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        simd_matches_scalar(&avx2_kernels);
+        strcat(tested, " avx2");
+    }
+    round_trip(1);
+    round_trip(2);
+    round_trip(3);
+    round_trip(4);
+    round_trip(8);
+    printf("scanline: %s (%s against scalar, %s dispatched)\n", failed ? "FAILED" : "ok",
+           tested[0] ? tested + 1 : "nothing", png_scanline_isa());
+    return failed;
+}